@@ -166,86 +166,125 @@ put_loop(ge_GIF *gif, uint16_t loop)
     write(gif->fd, "\0", 1);
 }
 
+/* Append bytes to a growing memory buffer, on failure the buffer is
+ * marked as failed and further bytes are dropped */
+static void
+append(ge_Buffer *out, const void *data, size_t size)
+{
+    uint8_t *resized;
+    size_t capacity;
+    if (out->failed)
+        return;
+    if (out->size + size > out->capacity) {
+        capacity = out->capacity ? out->capacity : 0x1000;
+        while (capacity < out->size + size)
+            capacity *= 2;
+        resized = realloc(out->data, capacity);
+        if (!resized) {
+            out->failed = 1;
+            return;
+        }
+        out->data = resized;
+        out->capacity = capacity;
+    }
+    memcpy(out->data + out->size, data, size);
+    out->size += size;
+}
+
+#define append_num(out, n) append((out), (uint8_t []) {(n) & 0xFF, (n) >> 8}, 2)
+
+/* State of the packing of keys into sub-blocks */
+typedef struct Packer {
+    ge_Buffer *out;
+    int offset;
+    uint32_t partial;
+    uint8_t buffer[0xFF];
+} Packer;
+
 /* Add packed key to buffer, updating offset and partial.
- *   gif->offset holds position to put next *bit*
- *   gif->partial holds bits to include in next byte */
+ *   packer->offset holds position to put next *bit*
+ *   packer->partial holds bits to include in next byte */
 static void
-put_key(ge_GIF *gif, uint16_t key, int key_size)
+put_key(Packer *packer, uint16_t key, int key_size)
 {
     int byte_offset, bit_offset, bits_to_write;
-    byte_offset = gif->offset / 8;
-    bit_offset = gif->offset % 8;
-    gif->partial |= ((uint32_t) key) << bit_offset;
+    byte_offset = packer->offset / 8;
+    bit_offset = packer->offset % 8;
+    packer->partial |= ((uint32_t) key) << bit_offset;
     bits_to_write = bit_offset + key_size;
     while (bits_to_write >= 8) {
-        gif->buffer[byte_offset++] = gif->partial & 0xFF;
+        packer->buffer[byte_offset++] = packer->partial & 0xFF;
         if (byte_offset == 0xFF) {
-            write(gif->fd, "\xFF", 1);
-            write(gif->fd, gif->buffer, 0xFF);
+            append(packer->out, "\xFF", 1);
+            append(packer->out, packer->buffer, 0xFF);
             byte_offset = 0;
         }
-        gif->partial >>= 8;
+        packer->partial >>= 8;
         bits_to_write -= 8;
     }
-    gif->offset = (gif->offset + key_size) % (0xFF * 8);
+    packer->offset = (packer->offset + key_size) % (0xFF * 8);
 }
 
 static void
-end_key(ge_GIF *gif)
+end_key(Packer *packer)
 {
     int byte_offset;
-    byte_offset = gif->offset / 8;
-    if (gif->offset % 8)
-        gif->buffer[byte_offset++] = gif->partial & 0xFF;
+    byte_offset = packer->offset / 8;
+    if (packer->offset % 8)
+        packer->buffer[byte_offset++] = packer->partial & 0xFF;
     if (byte_offset) {
-        write(gif->fd, (uint8_t []) {byte_offset}, 1);
-        write(gif->fd, gif->buffer, byte_offset);
+        append(packer->out, (uint8_t []) {byte_offset}, 1);
+        append(packer->out, packer->buffer, byte_offset);
     }
-    write(gif->fd, "\0", 1);
-    gif->offset = gif->partial = 0;
+    append(packer->out, "\0", 1);
+    packer->offset = packer->partial = 0;
 }
 
+/* Encode image descriptor and LZW data of the rect, the pixels of a row
+ * are followed by the next row after stride pixels */
 static void
-put_image(ge_GIF *gif, uint16_t w, uint16_t h, uint16_t x, uint16_t y)
+put_image(ge_Buffer *out, int depth, const uint8_t *pixels, int stride,
+    uint16_t w, uint16_t h, uint16_t x, uint16_t y)
 {
     int nkeys, key_size, i, j;
     Node *node, *child, *root;
-    int degree = 1 << gif->depth;
+    int degree = 1 << depth;
+    Packer packer = { out };
 
-    write(gif->fd, ",", 1);
-    write_num(gif->fd, x);
-    write_num(gif->fd, y);
-    write_num(gif->fd, w);
-    write_num(gif->fd, h);
-    write(gif->fd, (uint8_t []) {0x00, gif->depth}, 2);
+    append(out, ",", 1);
+    append_num(out, x);
+    append_num(out, y);
+    append_num(out, w);
+    append_num(out, h);
+    append(out, (uint8_t []) {0x00, depth}, 2);
     root = node = new_trie(degree, &nkeys);
-    key_size = gif->depth + 1;
-    put_key(gif, degree, key_size); /* clear code */
-    for (i = y; i < y+h; i++) {
-        for (j = x; j < x+w; j++) {
-            uint8_t pixel = gif->frame[i*gif->w+j] & (degree - 1);
+    key_size = depth + 1;
+    put_key(&packer, degree, key_size); /* clear code */
+    for (i = 0; i < h; i++) {
+        for (j = 0; j < w; j++) {
+            uint8_t pixel = pixels[i*stride+j] & (degree - 1);
             child = node->children[pixel];
             if (child) {
                 node = child;
             } else {
-                put_key(gif, node->key, key_size);
+                put_key(&packer, node->key, key_size);
                 if (nkeys < 0x1000) {
                     if (nkeys == (1 << key_size))
                         key_size++;
                     node->children[pixel] = new_node(nkeys++, degree);
                 } else {
-                    put_key(gif, degree, key_size); /* clear code */
+                    put_key(&packer, degree, key_size); /* clear code */
                     del_trie(root, degree);
                     root = node = new_trie(degree, &nkeys);
-                    key_size = gif->depth + 1;
+                    key_size = depth + 1;
                 }
                 node = root->children[pixel];
             }
         }
     }
-    put_key(gif, node->key, key_size);
-    put_key(gif, degree + 1, key_size); /* stop code */
-    end_key(gif);
+    put_key(&packer, node->key, key_size);
+    put_key(&packer, degree + 1, key_size); /* stop code */
+    end_key(&packer);
     del_trie(root, degree);
 }
 
@@ -280,12 +319,13 @@ get_bbox(ge_GIF *gif, uint16_t *w, uint16_t *h, uint16_t *x, uint16_t *y)
 }
 
 static void
-add_graphics_control_extension(ge_GIF *gif, uint16_t d)
+add_graphics_control_extension(ge_Buffer *out, uint16_t d, int disposal,
+    int transparent)
 {
-    uint8_t flags = ((gif->bgindex >= 0 ? 2 : 1) << 2) + 1;
-    write(gif->fd, (uint8_t []) {'!', 0xF9, 0x04, flags}, 4);
-    write_num(gif->fd, d);
-    write(gif->fd, (uint8_t []) {(uint8_t) gif->bgindex, 0x00}, 2);
+    uint8_t flags = (uint8_t) ((disposal << 2) + (transparent >= 0 ? 1 : 0));
+    append(out, (uint8_t []) {'!', 0xF9, 0x04, flags}, 4);
+    append_num(out, d);
+    append(out, (uint8_t []) {(uint8_t) (transparent >= 0 ? transparent : 0), 0x00}, 2);
 }
 
 void
@@ -293,9 +333,11 @@ ge_add_frame(ge_GIF *gif, uint16_t delay)
 {
     uint16_t w, h, x, y;
     uint8_t *tmp;
+    ge_Buffer out = { 0 };
 
     if (delay || (gif->bgindex >= 0))
-        add_graphics_control_extension(gif, delay);
+        add_graphics_control_extension(&out, delay,
+            gif->bgindex >= 0 ? 2 : 1, gif->bgindex);
     if (gif->nframes == 0) {
         w = gif->w;
         h = gif->h;
@@ -305,8 +347,9 @@ ge_add_frame(ge_GIF *gif, uint16_t delay)
         w = h = 1;
         x = y = 0;
     }
-    put_image(gif, w, h, x, y);
-    gif->nframes++;
+    put_image(&out, gif->depth, &gif->frame[y*gif->w+x], gif->w, w, h, x, y);
+    ge_write_frame(gif, &out);
+    ge_free_buffer(&out);
     if (gif->bgindex < 0) {
         tmp = gif->back;
         gif->back = gif->frame;
@@ -314,6 +357,35 @@ ge_add_frame(ge_GIF *gif, uint16_t delay)
     }
 }
 
+/* Only reads the gif's depth, so frames can be encoded concurrently */
+void
+ge_encode_frame(
+    const ge_GIF *gif, ge_Buffer *out, const uint8_t *pixels, int stride,
+    uint16_t delay, int disposal, int transparent,
+    uint16_t x, uint16_t y, uint16_t w, uint16_t h
+)
+{
+    add_graphics_control_extension(out, delay, disposal, transparent);
+    put_image(out, gif->depth, pixels, stride, w, h, x, y);
+}
+
+void
+ge_write_frame(ge_GIF *gif, const ge_Buffer *frame)
+{
+    if (frame->size)
+        write(gif->fd, frame->data, frame->size);
+    gif->nframes++;
+}
+
+void
+ge_free_buffer(ge_Buffer *buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = buffer->capacity = 0;
+    buffer->failed = 0;
+}
+
 void
 ge_close_gif(ge_GIF* gif)
 {
@@ -1,6 +1,7 @@
 #ifndef GIFENC_H
 #define GIFENC_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -12,18 +13,28 @@ typedef struct ge_GIF {
     int depth;
     int bgindex;
     int fd;
-    int offset;
     int nframes;
     uint8_t *frame, *back;
-    uint32_t partial;
-    uint8_t buffer[0xFF];
 } ge_GIF;
 
+typedef struct ge_Buffer {
+    uint8_t *data;
+    size_t size, capacity;
+    int failed;
+} ge_Buffer;
+
 ge_GIF *ge_new_gif(
     const char *fname, uint16_t width, uint16_t height,
     uint8_t *palette, int depth, int bgindex, int loop
 );
 void ge_add_frame(ge_GIF *gif, uint16_t delay);
+void ge_encode_frame(
+    const ge_GIF *gif, ge_Buffer *out, const uint8_t *pixels, int stride,
+    uint16_t delay, int disposal, int transparent,
+    uint16_t x, uint16_t y, uint16_t w, uint16_t h
+);
+void ge_write_frame(ge_GIF *gif, const ge_Buffer *frame);
+void ge_free_buffer(ge_Buffer *buffer);
 void ge_close_gif(ge_GIF* gif);
 
 #ifdef __cplusplus
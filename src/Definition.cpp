@@ -69,8 +69,12 @@ std::string_view get_definition_name(Definition definition) {
     case Definition::duplicates: return "duplicates";
     case Definition::alpha: return "alpha";
     case Definition::pack: return "pack";
+    case Definition::pack_time: return "pack-time";
+    case Definition::pack_incremental: return "pack-incremental";
     case Definition::scale: return "scale";
     case Definition::debug: return "debug";
+    case Definition::dither: return "dither";
+    case Definition::max_colors: return "max-colors";
     case Definition::path: return "path";
     case Definition::glob: return "glob";
     case Definition::input: return "input";
@@ -95,6 +99,8 @@ std::string_view get_definition_name(Definition definition) {
     case Definition::trim_threshold: return "trim-threshold";
     case Definition::trim_margin: return "trim-margin";
     case Definition::trim_channel: return "trim-channel";
+    case Definition::trim_vertices: return "trim-vertices";
+    case Definition::trim_tolerance: return "trim-tolerance";
     case Definition::crop: return "crop";
     case Definition::crop_pivot: return "crop-pivot";
     case Definition::extrude: return "extrude";
@@ -140,11 +146,15 @@ Definition get_affected_definition(Definition definition) {
     case Definition::padding:
     case Definition::duplicates:
     case Definition::pack:
+    case Definition::pack_time:
+    case Definition::pack_incremental:
       return Definition::sheet;
 
     case Definition::alpha:
     case Definition::scale:
     case Definition::debug:
+    case Definition::dither:
+    case Definition::max_colors:
       return Definition::output;
 
     case Definition::path:
@@ -166,6 +176,8 @@ Definition get_affected_definition(Definition definition) {
     case Definition::trim_threshold:
     case Definition::trim_margin:
     case Definition::trim_channel:
+    case Definition::trim_vertices:
+    case Definition::trim_tolerance:
     case Definition::crop:
     case Definition::crop_pivot:
     case Definition::extrude:
@@ -390,6 +402,9 @@ void apply_definition(Definition definition,
       else if (state.alpha == Alpha::colorkey) {
         state.alpha_color = check_color();
       }  
+      else if (state.alpha == Alpha::bleed) {
+        state.bleed_distance = (arguments_left() ? check_uint() : 0);
+      }
       break;
     }
 
@@ -397,13 +412,28 @@ void apply_definition(Definition definition,
       const auto string = check_string();
       if (const auto index = index_of(string, 
           { "binpack", "rows", "columns", "compact", 
-            "origin", "single", "layers", "keep" }); index >= 0)
+            "origin", "single", "layers", "keep", "skyline", "pixels",
+            "hierarchical" }); index >= 0)
         state.pack = static_cast<Pack>(index);
       else
         error("invalid pack method '", string, "'");
       break;
     }
 
+    case Definition::pack_time:
+      state.pack_time = check_real();
+      check(state.pack_time >= 0, "invalid pack time");
+      break;
+
+    case Definition::pack_incremental:
+      state.pack_incremental = check_path();
+      if (arguments_left()) {
+        state.max_fragmentation = check_real();
+        check(state.max_fragmentation >= 0 && 
+          state.max_fragmentation <= 1, "invalid fragmentation");
+      }
+      break;
+
     case Definition::scale:
       state.scale = check_real();
       check(state.scale >= 0.01 && state.scale < 100, "invalid scale");
@@ -423,6 +453,22 @@ void apply_definition(Definition definition,
       state.debug = check_bool(true);
       break;
 
+    case Definition::dither: {
+      const auto string = check_string();
+      if (const auto index = index_of(string, 
+          { "floyd-steinberg", "ordered", "none" }); index >= 0)
+        state.dither = static_cast<Dither>(index);
+      else
+        error("invalid dither mode '", string, "'");
+      break;
+    }
+
+    case Definition::max_colors:
+      state.max_colors = check_uint();
+      check(state.max_colors >= 2 && state.max_colors <= 256, 
+        "max-colors must be between 2 and 256");
+      break;
+
     case Definition::path:
       state.path = check_path();
       break;
@@ -544,7 +590,7 @@ void apply_definition(Definition definition,
     case Definition::trim: {
       const auto string = check_string();
       if (const auto index = index_of(string, 
-          { "none", "rect", "convex" }); index >= 0)
+          { "none", "rect", "convex", "polygon" }); index >= 0)
         state.trim = static_cast<Trim>(index);
       else
         error("invalid trim value '", string, "'");
@@ -567,6 +613,16 @@ void apply_definition(Definition definition,
       break;
     }
 
+    case Definition::trim_vertices:
+      state.trim_vertices = check_uint();
+      check(state.trim_vertices >= 3, "invalid vertex count");
+      break;
+
+    case Definition::trim_tolerance:
+      state.trim_tolerance = check_real();
+      check(state.trim_tolerance >= 0, "invalid tolerance");
+      break;
+
     case Definition::crop:
       state.crop = check_bool(true);
       break;
@@ -24,8 +24,12 @@ enum class Definition {
   duplicates,
   alpha,
   pack,
+  pack_time,
+  pack_incremental,
   scale,
   debug,
+  dither,
+  max_colors,
 
   path,
   glob,
@@ -52,6 +56,8 @@ enum class Definition {
   trim_threshold,
   trim_margin,
   trim_channel,
+  trim_vertices,
+  trim_tolerance,
   crop,
   crop_pivot,
   extrude,
@@ -87,10 +93,16 @@ struct State {
   Duplicates duplicates{ };
   Alpha alpha{ };
   RGBA alpha_color{ };
+  int bleed_distance{ };
   Pack pack{ };
+  real pack_time{ };
+  std::filesystem::path pack_incremental;
+  real max_fragmentation{ 0.5 };
   real scale{ 1.0 };
   ResizeFilter scale_filter{ };
   bool debug{ };
+  Dither dither{ };
+  int max_colors{ };
 
   std::filesystem::path path;
   std::string glob_pattern;
@@ -116,6 +128,8 @@ struct State {
   int trim_threshold{ 1 };
   int trim_margin{ };
   bool trim_gray_levels{ };
+  int trim_vertices{ 16 };
+  real trim_tolerance{ 2 };
   bool crop{ };
   bool crop_pivot{ };
   Extrude extrude{ };
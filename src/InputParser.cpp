@@ -193,6 +193,8 @@ void InputParser::sprite_ends(State& state) {
   sprite.trim_margin = state.trim_margin;
   sprite.trim_threshold = state.trim_threshold;
   sprite.trim_gray_levels = state.trim_gray_levels;
+  sprite.trim_vertices = state.trim_vertices;
+  sprite.trim_tolerance = state.trim_tolerance;
   sprite.crop = state.crop;
   sprite.crop_pivot = state.crop_pivot;
   sprite.extrude = state.extrude;
@@ -325,16 +327,15 @@ void InputParser::deduce_grid_sprites(State& state) {
   auto& y = m_current_grid_cell.y;
 
   const auto is_update = (sprites_or_skips_in_current_input() != 0);
+  const auto& used_pixels = source->used_pixels(
+    state.trim_gray_levels, state.trim_threshold);
   for (; y < cells_y; y += state.span.y) {
     auto output_offset = (x != 0);
     auto skipped = 0;
     for (; x < cells_x; x += state.span.x) {      
       const auto rect = intersect(deduce_rect_from_grid(state), source->bounds());
 
-      if (empty(rect) ||
-          (state.trim_gray_levels ?
-           is_fully_black(*source, state.trim_threshold, rect) :
-           is_fully_transparent(*source, state.trim_threshold, rect))) {
+      if (empty(rect) || used_pixels.is_empty(rect)) {
         ++skipped;
         continue;
       }
@@ -426,6 +427,10 @@ void InputParser::sheet_ends(State& state) {
   sheet.shape_padding = state.shape_padding;
   sheet.duplicates = state.duplicates;
   sheet.pack = state.pack;
+  sheet.pack_time = state.pack_time;
+  if (!state.pack_incremental.empty())
+    sheet.pack_incremental = m_settings.output_path / state.pack_incremental;
+  sheet.max_fragmentation = state.max_fragmentation;
 }
 
 void InputParser::output_ends(State& state) {
@@ -437,9 +442,12 @@ void InputParser::output_ends(State& state) {
   output->map_suffixes = state.map_suffixes;
   output->alpha = state.alpha;
   output->alpha_color = state.alpha_color;
+  output->bleed_distance = state.bleed_distance;
   output->scale = state.scale;
   output->scale_filter = state.scale_filter;
   output->debug = state.debug;
+  output->dither = state.dither;
+  output->max_colors = state.max_colors;
 }
 
 void InputParser::deduce_globbed_inputs(State& state) {
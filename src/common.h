@@ -165,4 +165,18 @@ static_assert(floor_to_pot(6) == 4);
 static_assert(floor_to_pot(7) == 4);
 static_assert(floor_to_pot(8) == 8);
 
+constexpr int floor_log2(int value) {
+  auto result = 0;
+  for (; value > 1; value >>= 1)
+    ++result;
+  return result;
+}
+static_assert(floor_log2(0) == 0);
+static_assert(floor_log2(1) == 0);
+static_assert(floor_log2(2) == 1);
+static_assert(floor_log2(3) == 1);
+static_assert(floor_log2(4) == 2);
+static_assert(floor_log2(7) == 2);
+static_assert(floor_log2(8) == 3);
+
 } // namespace
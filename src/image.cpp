@@ -4,15 +4,18 @@
 #include "stb/stb_image_write.h"
 #include "stb/stb_image_resize.h"
 #include "gifenc/gifenc.h"
+#include "miniz/miniz.h"
 #include "nonstd/span.hpp"
 #include <array>
 #include <algorithm>
 #include <stdexcept>
 #include <cstring>
 #include <utility>
-
-#define TEXBLEED_IMPLEMENTATION
-#include "rmj/rmj_texbleed.h"
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace spright {
 
@@ -24,37 +27,29 @@ namespace {
       throw std::logic_error("access outside image bounds");
   }
 
-  inline void check_rect(const Image& image, const Rect& rect) {
+  inline void check_rect(const ImageView& image, const Rect& rect) {
     check(containing(image.bounds(), rect));
   }
 
-  inline const RGBA& checked_rgba_at(const Image& image, const Point& p) {
-    check(containing(image.bounds(), p));
-    return image.rgba_at(p);
-  }
-
-  inline RGBA& checked_rgba_at(Image& image, const Point& p) {
-    check(containing(image.bounds(), p));
-    return image.rgba_at(p);
-  }
-
   template <typename P>
-  bool all_of(const Image& image, const Rect& rect, P&& predicate) {
-    check_rect(image, rect);
-    const auto rgba = image.rgba();
-    for (auto y = rect.y; y < rect.y + rect.h; ++y)
-      for (auto x = rect.x; x < rect.x + rect.w; ++x)
-        if (!predicate(rgba[y * image.width() + x]))
+  bool all_of(const ImageView& image, P&& predicate) {
+    const auto& rect = image.bounds();
+    for (auto y = rect.y; y < rect.y1(); ++y) {
+      const auto row = image.row(y);
+      for (auto x = rect.x; x < rect.x1(); ++x)
+        if (!predicate(row[x]))
           return false;
+    }
     return true;
   }
 
   template <typename F>
-  void for_each_pixel(const Image& image, Rect rect, F&& func) {
-    for (auto y = 0; y < rect.h; ++y) {
-      auto row = image.rgba() + image.width() * (rect.y + y) + rect.x;
-      for (auto x = 0; x < rect.w; ++x, ++row)
-        func(*row);
+  void for_each_pixel(const ImageView& image, F&& func) {
+    const auto& rect = image.bounds();
+    for (auto y = rect.y; y < rect.y1(); ++y) {
+      const auto row = image.row(y);
+      for (auto x = rect.x; x < rect.x1(); ++x)
+        func(row[x]);
     }
   }
 
@@ -67,91 +62,227 @@ namespace {
     a.a = std::max(a.a, b.a);
   }
 
-  template <int sides, // 4 or 8
-    typename Color,
-    typename GetPixel, // Color&(int x, int y)
-    typename Match, // bool Match(Color color)
-    typename Count> // void Count(int x, int y)
-  void flood_fill(
-      int start_x, int start_y,
-      int w, int h,
-      const Color& new_color,
-      GetPixel&& get_pixel,
-      Match&& match,
-      Count&& count = [](int, int) {}) {
-
-    // cancel when new color is indistinguishable from rest
-    if (match(new_color))
-      return;
+  // islands are labeled in strips of rows in parallel, then joined at the seams
+  const auto island_strip_size = 256;
 
-    auto stack = std::vector<Point>();
-    const auto add = [&](auto x, auto y) {
-      auto& pixel = get_pixel(x, y);
-      if (match(pixel)) {
-        pixel = new_color;
-        stack.push_back(Point{ x, y });
-      }
-    };
-    add(start_x, start_y);
+  // a horizontal run of non-empty pixels [x0, x1) in row y
+  struct Run {
+    int y;
+    int x0;
+    int x1;
+  };
 
-    while (!stack.empty()) {
-      const auto [x, y] = stack.back();
-      stack.pop_back();
-      count(x, y);
+  struct LabeledStrip {
+    std::vector<Run> runs;
+    std::vector<size_t> parents;
+    size_t last_row_begin{ };
+  };
 
-      if (y > 0) add(x, y - 1);
-      if (y < h - 1) add(x, y + 1);
-      if (sides == 4) {
-        if (x > 0) add(x - 1, y);
-        if (x < w - 1) add(x + 1, y);
-      }
-      else {
-        if (x > 0) {
-          add(x - 1, y);
-          if (y > 0) add(x - 1, y - 1);
-          if (y < h - 1) add(x - 1, y + 1);
-        }
-        if (x < w - 1) {
-          add(x + 1, y);
-          if (y > 0) add(x + 1, y - 1);
-          if (y < h - 1) add(x + 1, y + 1);
+  size_t find_root(std::vector<size_t>& parents, size_t index) {
+    while (parents[index] != index) {
+      parents[index] = parents[parents[index]];
+      index = parents[index];
+    }
+    return index;
+  }
+
+  // sets are represented by their first element
+  void join(std::vector<size_t>& parents, size_t a, size_t b) {
+    a = find_root(parents, a);
+    b = find_root(parents, b);
+    if (a < b)
+      parents[b] = a;
+    else if (b < a)
+      parents[a] = b;
+  }
+
+  // joins the runs of a row with the 8-connected runs of the previous row
+  void join_rows(const std::vector<Run>& runs, std::vector<size_t>& parents,
+      size_t prev_begin, size_t prev_end, size_t begin, size_t end) {
+    auto prev = prev_begin;
+    for (auto i = begin; i < end; ++i) {
+      const auto& run = runs[i];
+      while (prev < prev_end && runs[prev].x1 < run.x0)
+        ++prev;
+      for (auto j = prev; j < prev_end && runs[j].x0 <= run.x1; ++j)
+        join(parents, j, i);
+    }
+  }
+
+  void label_strip(const ChannelView& levels, int y0, int y1, LabeledStrip& strip) {
+    const auto x0 = levels.bounds().x;
+    const auto x1 = levels.bounds().x1();
+    auto& runs = strip.runs;
+    auto prev_begin = size_t{ };
+    for (auto y = y0; y < y1; ++y) {
+      const auto row = levels.row(y);
+      const auto begin = runs.size();
+      for (auto x = x0; x < x1; ++x)
+        if (levels.value(row[x])) {
+          const auto run_x0 = x;
+          while (x < x1 && levels.value(row[x]))
+            ++x;
+          strip.parents.push_back(runs.size());
+          runs.push_back({ y, run_x0, x });
         }
-      }
+      if (y > y0)
+        join_rows(runs, strip.parents, prev_begin, begin, begin, runs.size());
+      prev_begin = begin;
     }
+    strip.last_row_begin = prev_begin;
   }
 
-  void merge_adjacent_rects(const Image& image, std::vector<Rect>& rects,
-      int distance, bool gray_levels) {
+  void merge_adjacent_rects(const UsedPixels& used_pixels,
+      std::vector<Rect>& rects, int distance) {
+    if (rects.size() < 2)
+      return;
 
-    const auto adjacent = [&](const Rect& a, const Rect& b) {
+    const auto has_content = [&](const Rect& a, const Rect& b) {
       const auto intersection = intersect(a, expand(b, distance));
-      if (empty(intersection))
-        return false;
-      if (gray_levels)
-        return !is_fully_black(image, 1, intersection);
-      return !is_fully_transparent(image, 1, intersection);
+      return (!empty(intersection) && !used_pixels.is_empty(intersection));
+    };
+    const auto adjacent = [&](const Rect& a, const Rect& b) {
+      return (has_content(a, b) || has_content(b, a));
     };
 
-    for (;;) {
-      auto merged = false;
-      for (auto i = size_t{ }; i < rects.size(); ++i) {
-        auto& a = rects[i];
-        for (auto j = i + 1; j < rects.size(); ) {
-          auto& b = rects[j];
-          if (adjacent(a, b)) {
-            a = combine(a, b);
-            b = rects.back();
-            rects.pop_back();
-            merged = true;
-          }
-          else {
-            ++j;
-          }
-        }
+    // uniform grid with cells about the size of an average rect,
+    // rects are added to all cells they overlap within the distance
+    const auto margin = std::max(distance, 0);
+    auto bounds = rects.front();
+    auto size_sum = real{ };
+    for (const auto& rect : rects) {
+      bounds = combine(bounds, rect);
+      size_sum += std::max(rect.w, rect.h);
+    }
+    bounds = expand(bounds, margin);
+    const auto cell_size = std::max(
+      to_int(size_sum / to_real(rects.size())) + margin, 8);
+    const auto columns = div_ceil(bounds.w, cell_size);
+    auto cells = std::vector<std::vector<size_t>>(
+      to_unsigned(columns * div_ceil(bounds.h, cell_size)));
+
+    const auto get_cell_range = [&](const Rect& rect, int margin) {
+      const auto x0 = (rect.x - margin - bounds.x) / cell_size;
+      const auto y0 = (rect.y - margin - bounds.y) / cell_size;
+      const auto x1 = (rect.x1() + margin - 1 - bounds.x) / cell_size;
+      const auto y1 = (rect.y1() + margin - 1 - bounds.y) / cell_size;
+      return Rect{ x0, y0, x1 - x0 + 1, y1 - y0 + 1 };
+    };
+    const auto get_cell = [&](int x, int y) -> std::vector<size_t>& {
+      return cells[to_unsigned(y * columns + x)];
+    };
+    const auto insert = [&](size_t index, const Rect& previous_range) {
+      const auto range = get_cell_range(rects[index], margin);
+      for (auto y = range.y; y < range.y1(); ++y)
+        for (auto x = range.x; x < range.x1(); ++x)
+          if (!containing(previous_range, Point{ x, y }))
+            get_cell(x, y).push_back(index);
+    };
+    for (auto i = size_t{ }; i < rects.size(); ++i)
+      insert(i, { });
+
+    auto merged_into = std::vector<bool>(rects.size());
+    auto visited = std::vector<size_t>(rects.size());
+    auto pass = size_t{ };
+    for (auto i = size_t{ }; i < rects.size(); ++i) {
+      if (merged_into[i])
+        continue;
+
+      // repeat until rect stops growing
+      for (auto merged = true; merged; ) {
+        merged = false;
+        visited[i] = ++pass;
+        const auto previous_range = get_cell_range(rects[i], margin);
+        const auto range = get_cell_range(rects[i], 0);
+        for (auto y = range.y; y < range.y1(); ++y)
+          for (auto x = range.x; x < range.x1(); ++x)
+            for (auto j : get_cell(x, y)) {
+              if (merged_into[j] || visited[j] == pass)
+                continue;
+              visited[j] = pass;
+              if (adjacent(rects[i], rects[j])) {
+                rects[i] = combine(rects[i], rects[j]);
+                merged_into[j] = true;
+                merged = true;
+              }
+            }
+        if (merged)
+          insert(i, previous_range);
       }
-      if (!merged)
-        break;
     }
+
+    auto it = rects.begin();
+    for (auto i = size_t{ }; i < merged_into.size(); ++i)
+      if (!merged_into[i])
+        *it++ = rects[i];
+    rects.erase(it, rects.end());
+  }
+
+  std::vector<Rect> label_islands(const ImageView& image,
+      const UsedPixels& used_pixels, int merge_distance) {
+    const auto levels = ChannelView(image, used_pixels.gray_levels());
+    const auto& bounds = levels.bounds();
+    auto strips = std::vector<LabeledStrip>(
+      to_unsigned(div_ceil(bounds.h, island_strip_size)));
+    scheduler.for_each_parallel([&](size_t index) {
+      const auto y0 = bounds.y + to_int(index) * island_strip_size;
+      const auto y1 = std::min(y0 + island_strip_size, bounds.y1());
+      label_strip(levels, y0, y1, strips[index]);
+    }, strips.size());
+
+    // concatenate strips and join at seams
+    auto runs = std::vector<Run>();
+    auto parents = std::vector<size_t>();
+    auto prev_row_begin = size_t{ };
+    for (auto& strip : strips) {
+      const auto offset = runs.size();
+      runs.insert(runs.end(), strip.runs.begin(), strip.runs.end());
+      for (auto parent : strip.parents)
+        parents.push_back(parent + offset);
+
+      if (offset > 0 && !strip.runs.empty()) {
+        const auto y0 = strip.runs.front().y;
+        auto first_row_end = offset;
+        while (first_row_end < runs.size() && runs[first_row_end].y == y0)
+          ++first_row_end;
+        if (runs[offset - 1].y == y0 - 1)
+          join_rows(runs, parents, prev_row_begin, offset, offset, first_row_end);
+      }
+      if (!strip.runs.empty())
+        prev_row_begin = offset + strip.last_row_begin;
+    }
+
+    // islands are ordered by their first run
+    auto islands = std::vector<Rect>();
+    auto island_indices = std::vector<size_t>(runs.size());
+    for (auto i = size_t{ }; i < runs.size(); ++i) {
+      const auto& run = runs[i];
+      const auto rect = Rect{ run.x0, run.y, run.x1 - run.x0, 1 };
+      const auto root = find_root(parents, i);
+      if (root == i) {
+        island_indices[i] = islands.size();
+        islands.push_back(rect);
+      }
+      else {
+        auto& island = islands[island_indices[root]];
+        island = combine(island, rect);
+      }
+    }
+
+    merge_adjacent_rects(used_pixels, islands, merge_distance);
+
+    // fuzzy sort from top to bottom, left to right
+    const auto center_considerably_less = [](const Rect& a, const Rect& b) {
+      const auto row_tolerance = std::min(a.h, b.h) / 4;
+      const auto ca = a.center();
+      const auto cb = b.center();
+      if (ca.y < cb.y - row_tolerance) return true;
+      if (cb.y < ca.y - row_tolerance) return false;
+      return std::tie(ca.x, ca.y) < std::tie(cb.x, cb.y);
+    };
+    std::stable_sort(begin(islands), end(islands), center_considerably_less);
+
+    return islands;
   }
 
   // https://en.wikipedia.org/wiki/Bresenham's_line_algorithm
@@ -184,34 +315,301 @@ namespace {
     }
   }
 
-  // http://paulbourke.net/geometry/polygonmesh/
-  bool point_in_polygon(real x, real y, const std::vector<PointF>& p) {
-    auto c = false;
-    for (auto i = size_t{ }, j = p.size() - 1; i < p.size(); j = i++) {
-      if ((((p[i].y <= y) && (y < p[j].y)) ||
-           ((p[j].y <= y) && (y < p[i].y))) &&
-          (x < (p[j].x - p[i].x) * (y - p[i].y) / (p[j].y - p[i].y) + p[i].x))
-        c = !c;
+  // calls func(x0, x1) for each span of pixels in row y, whose centers are
+  // inside the polygon (even-odd rule, see http://paulbourke.net/geometry/polygonmesh/)
+  template <typename F>
+  void for_each_polygon_span(const std::vector<PointF>& p, int y, int width,
+      std::vector<real>& crossings, F&& func) {
+    const auto cy = y + 0.5;
+    crossings.clear();
+    for (auto i = size_t{ }, j = p.size() - 1; i < p.size(); j = i++)
+      if (((p[i].y <= cy) && (cy < p[j].y)) ||
+          ((p[j].y <= cy) && (cy < p[i].y)))
+        crossings.push_back(
+          (p[j].x - p[i].x) * (cy - p[i].y) / (p[j].y - p[i].y) + p[i].x);
+    std::sort(crossings.begin(), crossings.end());
+
+    // pixel is inside when crossings[i] <= x + 0.5 < crossings[i + 1]
+    for (auto i = size_t{ }; i + 1 < crossings.size(); i += 2) {
+      const auto x0 = std::max(to_int(std::ceil(crossings[i] - 0.5)), 0);
+      const auto x1 = std::min(to_int(std::ceil(crossings[i + 1] - 0.5)), width);
+      if (x0 < x1)
+        func(x0, x1);
+    }
+  }
+
+  // pixels with an alpha above the threshold are bled into fully transparent pixels
+  const auto bleed_threshold = 128;
+  const auto bleed_band_size = 64;
+
+  bool is_bleed_source(const RGBA& rgba) {
+    return (rgba.a > bleed_threshold);
+  }
+
+  // for each pixel of the window, find the row of the nearest source in its
+  // column. Processes the columns [x0, x1) row by row to stay cache friendly.
+  void find_nearest_in_columns(const Image& image, const Rect& window,
+      int x0, int x1, int max_distance, int* rows) {
+    const auto w = x1 - x0;
+    auto last = std::vector<int>(to_unsigned(w), -1);
+    for (auto y = window.y; y < window.y1(); ++y) {
+      auto row = rows + (y - window.y) * window.w + (x0 - window.x);
+      const auto rgba = &image.rgba_at({ x0, y });
+      for (auto x = 0; x < w; ++x) {
+        if (is_bleed_source(rgba[x]))
+          last[to_unsigned(x)] = y;
+        row[x] = last[to_unsigned(x)];
+      }
+    }
+
+    auto& next = last;
+    std::fill(next.begin(), next.end(), -1);
+    for (auto y = window.y1() - 1; y >= window.y; --y) {
+      auto row = rows + (y - window.y) * window.w + (x0 - window.x);
+      const auto rgba = &image.rgba_at({ x0, y });
+      for (auto x = 0; x < w; ++x) {
+        auto& n = next[to_unsigned(x)];
+        if (is_bleed_source(rgba[x]))
+          n = y;
+        if (n >= 0 && (row[x] < 0 || n - y < y - row[x]))
+          row[x] = n;
+        if (max_distance > 0 && row[x] >= 0 && std::abs(row[x] - y) > max_distance)
+          row[x] = -1;
+      }
+    }
+  }
+
+  // find the nearest source of each transparent pixel in the rows [y0, y1)
+  // using the lower envelope of the parabolas of the column distances
+  // https://cs.brown.edu/people/pfelzens/papers/dt-final.pdf
+  void bleed_rows(Image& image, const Rect& window, int y0, int y1,
+      int max_distance, const int* rows) {
+    const auto w = window.w;
+    auto sites = std::vector<int>(to_unsigned(w));
+    auto bounds = std::vector<real>(to_unsigned(w) + 1);
+
+    for (auto y = y0; y < y1; ++y) {
+      const auto row = rows + (y - window.y) * w;
+      const auto f = [&](int x) {
+        const auto dy = to_real(row[x] - y);
+        return dy * dy;
+      };
+      const auto sq = [](int x) { return to_real(x) * to_real(x); };
+
+      auto k = -1;
+      for (auto q = 0; q < w; ++q) {
+        if (row[q] < 0)
+          continue;
+        auto s = real{ };
+        while (k >= 0) {
+          const auto v = sites[to_unsigned(k)];
+          s = ((f(q) + sq(q)) - (f(v) + sq(v))) / to_real(2 * (q - v));
+          if (s > bounds[to_unsigned(k)])
+            break;
+          --k;
+        }
+        ++k;
+        sites[to_unsigned(k)] = q;
+        bounds[to_unsigned(k)] = (k > 0 ? s : -std::numeric_limits<real>::infinity());
+        bounds[to_unsigned(k) + 1] = std::numeric_limits<real>::infinity();
+      }
+      if (k < 0)
+        continue;
+
+      auto rgba = &image.rgba_at({ window.x, y });
+      for (auto x = 0, j = 0; x < w; ++x) {
+        while (bounds[to_unsigned(j) + 1] < to_real(x))
+          ++j;
+        auto& pixel = rgba[x];
+        if (pixel.a != 0)
+          continue;
+        const auto v = sites[to_unsigned(j)];
+        if (max_distance > 0 && sq(x - v) + f(v) > sq(max_distance))
+          continue;
+        const auto& source = image.rgba_at({ window.x + v, row[v] });
+        // only write color channels, alpha is concurrently read by other bands
+        pixel.r = source.r;
+        pixel.g = source.g;
+        pixel.b = source.b;
+      }
+    }
+  }
+
+  // merge the horizontal extents of the rects overlapping the rows [y0, y1)
+  std::vector<std::pair<int, int>> get_row_intervals(
+      const std::vector<Rect>& rects, int y0, int y1) {
+    auto intervals = std::vector<std::pair<int, int>>();
+    for (const auto& rect : rects)
+      if (rect.y < y1 && rect.y1() > y0)
+        intervals.emplace_back(rect.x, rect.x1());
+    std::sort(intervals.begin(), intervals.end());
+    auto merged = std::vector<std::pair<int, int>>();
+    for (const auto& interval : intervals) {
+      if (!merged.empty() && interval.first <= merged.back().second)
+        merged.back().second = std::max(merged.back().second, interval.second);
+      else
+        merged.push_back(interval);
     }
-    return c;
+    return merged;
   }
 
+  struct ColorCount {
+    RGBA color;
+    uint64_t count;
+  };
+  using ColorCountSpan = nonstd::span<ColorCount>;
+
+  // colors binned by 5 bits of red, green, blue and 3 bits of alpha,
+  // the sum of the colors in a bin is kept for computing their average.
+  // Small inputs populate only a few bins, which are kept in a map
+  class ColorHistogram {
+  public:
+    void add(const ImageView& image, bool visible_only = false) {
+      const auto& rect = image.bounds();
+      const auto pixels = int64_t{ rect.w } * rect.h;
+      if (m_bins.empty()) {
+        if (static_cast<int64_t>(m_sparse_bins.size()) + pixels <= max_sparse_bins)
+          return add_rows(m_sparse_bins, image, rect.y, rect.y1(), visible_only);
+
+        m_bins.resize(bin_count);
+        for (const auto& [index, bin] : m_sparse_bins)
+          m_bins[index] = bin;
+        m_sparse_bins.clear();
+      }
+
+      // histograms of bands of rows are built in parallel
+      const auto band_count = static_cast<int>(std::clamp(
+        pixels / histogram_band_pixels, int64_t{ 1 },
+        int64_t{ std::min(max_histogram_bands, rect.h) }));
+      if (band_count == 1)
+        return add_rows(m_bins, image, rect.y, rect.y1(), visible_only);
+
+      // the 32 bit sums of a band must not overflow, so large
+      // images are processed in rounds, reusing the band histograms
+      const auto round_pixels = band_count * max_band_pixels;
+      const auto rounds = static_cast<int>(std::min(int64_t{ rect.h / band_count },
+        (pixels + round_pixels - 1) / round_pixels));
+      const auto parts = band_count * rounds;
+      m_band_bins.resize(to_unsigned(band_count));
+      for (auto round = 0; round < rounds; ++round) {
+        scheduler.for_each_parallel([&](size_t index) {
+          auto& bins = m_band_bins[index];
+          if (bins.empty())
+            bins.resize(bin_count);
+          const auto part = round * band_count + to_int(index);
+          add_rows(bins, image,
+            rect.y + static_cast<int>(int64_t{ rect.h } * part / parts),
+            rect.y + static_cast<int>(int64_t{ rect.h } * (part + 1) / parts), visible_only);
+        }, m_band_bins.size());
+        for (auto& bins : m_band_bins)
+          merge(bins);
+      }
+    }
+
+    // average color of each bin
+    std::vector<ColorCount> colors() const {
+      auto colors = std::vector<ColorCount>();
+      const auto add_color = [&](const TotalBin& bin) {
+        auto color = RGBA{ };
+        for (auto c = size_t{ }; c < 4; ++c)
+          color.channel(to_int(c)) = static_cast<uint8_t>(bin.sum[c] / bin.count);
+        colors.push_back({ color, bin.count });
+      };
+      if (m_bins.empty()) {
+        // in the order of the dense bins
+        auto indices = std::vector<size_t>();
+        indices.reserve(m_sparse_bins.size());
+        for (const auto& entry : m_sparse_bins)
+          indices.push_back(entry.first);
+        std::sort(indices.begin(), indices.end());
+        for (auto index : indices)
+          add_color(m_sparse_bins.at(index));
+      }
+      else {
+        for (const auto& bin : m_bins)
+          if (bin.count)
+            add_color(bin);
+      }
+      return colors;
+    }
+
+  private:
+    static constexpr auto bin_count = size_t{ 1 } << 18;
+    static constexpr auto max_sparse_bins = int64_t{ 1 } << 14;
+    // a band only pays off when it fills its bins several times
+    static constexpr auto histogram_band_pixels = int64_t{ bin_count } * 4;
+    static constexpr auto max_histogram_bands = 8;
+    static constexpr auto max_band_pixels = int64_t{ 1 } << 24;
+
+    template<typename T>
+    struct Bin {
+      T count;
+      std::array<T, 4> sum;
+    };
+    // the bins of a band take half the memory
+    using BandBin = Bin<uint32_t>;
+    using TotalBin = Bin<uint64_t>;
+
+    static size_t get_bin(const RGBA& color) {
+      return (size_t{ color.r } >> 3) << 13 | (size_t{ color.g } >> 3) << 8 |
+             (size_t{ color.b } >> 3) << 3 | (size_t{ color.a } >> 5);
+    }
+
+    // adds the bins of a band and clears them for the next round
+    void merge(std::vector<BandBin>& bins) {
+      for (auto i = size_t{ }; i < bins.size(); ++i) {
+        auto& bin = bins[i];
+        if (!bin.count)
+          continue;
+        m_bins[i].count += bin.count;
+        for (auto c = size_t{ }; c < 4; ++c)
+          m_bins[i].sum[c] += bin.sum[c];
+        bin = { };
+      }
+    }
+
+    template<typename Bins>
+    static void add_rows(Bins& bins, const ImageView& image,
+        int y0, int y1, bool visible_only) {
+      const auto& rect = image.bounds();
+      for (auto y = y0; y < y1; ++y) {
+        const auto row = image.row(y);
+        for (auto x = rect.x; x < rect.x1(); ++x) {
+          const auto& color = row[x];
+          if (visible_only && !color.a)
+            continue;
+          auto& bin = bins[get_bin(color)];
+          ++bin.count;
+          for (auto c = size_t{ }; c < 4; ++c)
+            bin.sum[c] += color.channel(to_int(c));
+        }
+      }
+    }
+
+    std::unordered_map<size_t, TotalBin> m_sparse_bins;
+    std::vector<TotalBin> m_bins;
+    std::vector<std::vector<BandBin>> m_band_bins;
+  };
+
   // https://en.wikipedia.org/wiki/Median_cut
-  std::vector<RGBA> median_cut_reduction(RGBASpan image, int max_colors) {
+  // operating on the distinct colors, which are weighted by their count
+  std::vector<RGBA> median_cut_reduction(ColorCountSpan color_counts, int max_colors) {
     struct Bucket {
       uint8_t max_channel_range;
-      RGBASpan colors;
+      ColorCountSpan colors;
     };
   
     auto buckets = std::vector<Bucket>();
-    const auto insert_bucket = [&](RGBASpan colors) {
+    const auto insert_bucket = [&](ColorCountSpan colors) {
       // compute channel with maximum range
       auto max_channel = 0;
       auto max_channel_range = uint8_t{ };
       for (auto i = 0; i < 4; ++i) {
         const auto [min, max] = std::minmax_element(colors.begin(), colors.end(),
-          [&](const RGBA& a, const RGBA& b) { return a.channel(i) < b.channel(i); });
-        const auto channel_range = to_byte(max->channel(i) - min->channel(i));
+          [&](const ColorCount& a, const ColorCount& b) {
+            return a.color.channel(i) < b.color.channel(i);
+          });
+        const auto channel_range = to_byte(max->color.channel(i) - min->color.channel(i));
         if (channel_range > max_channel_range) {
           max_channel_range = channel_range;
           max_channel = i;
@@ -220,8 +618,8 @@ namespace {
 
       // sort colors by this channel
       std::sort(colors.begin(), colors.end(), 
-        [&](const RGBA& a, const RGBA& b) { 
-          return a.channel(max_channel) < b.channel(max_channel); 
+        [&](const ColorCount& a, const ColorCount& b) { 
+          return a.color.channel(max_channel) < b.color.channel(max_channel); 
         });
 
       // insert sorted in bucket list
@@ -232,43 +630,80 @@ namespace {
         }), bucket);
     };
 
-    // start with one bucket containing whole image
-    insert_bucket(image);
+    // start with one bucket containing all colors
+    if (color_counts.empty())
+      return { };
+    insert_bucket(color_counts);
 
     while (to_int(buckets.size()) < max_colors) {
-      // split bucket with maximum range
+      // split bucket with maximum range at the median pixel
       auto [range, colors] = buckets.back();
       if (range == 0)
         break;
 
+      auto total = uint64_t{ };
+      for (const auto& color : colors)
+        total += color.count;
+      auto split = size_t{ 1 };
+      for (auto sum = uint64_t{ }; split < colors.size() - 1; ++split) {
+        sum += colors[split - 1].count;
+        if (sum * 2 >= total)
+          break;
+      }
+
       buckets.pop_back();
-      insert_bucket(colors.subspan(0, colors.size() / 2));
-      insert_bucket(colors.subspan(colors.size() / 2));
+      insert_bucket(colors.subspan(0, split));
+      insert_bucket(colors.subspan(split));
     }
 
     // get average colors of buckets
     auto palette = Palette();
     for (const auto& bucket : buckets) {
-      auto sum = std::array<uint32_t, 4>();
-      for (const auto& color : bucket.colors)
+      auto sum = std::array<uint64_t, 4>();
+      auto count = uint64_t{ };
+      for (const auto& color : bucket.colors) {
         for (auto i = 0; i < 4; ++i)
-          sum[to_unsigned(i)] += color.channel(i);
+          sum[to_unsigned(i)] += uint64_t{ color.color.channel(i) } * color.count;
+        count += color.count;
+      }
       auto color = RGBA{ };
       for (auto i = 0; i < 4; ++i)
-        color.channel(i) = to_byte(sum[to_unsigned(i)] / bucket.colors.size());
+        color.channel(i) = static_cast<uint8_t>(sum[to_unsigned(i)] / count);
       palette.push_back(color);
     }
     return palette;
   }
 
-  int index_of_closest_palette_color(const Palette& palette, const RGBA& color) {
+  // composes a batch of frames in parallel and passes the results
+  // of map to reduce in order, so only a few frames are in memory
+  const auto frame_batch_size = size_t{ 4 };
+  const auto gif_encode_batch_size = size_t{ 16 };
+
+  template<typename Map, typename Reduce>
+  void for_each_frame(const Animation& animation, Map&& map, Reduce&& reduce) {
+    using Result = std::invoke_result_t<Map, Image>;
+    const auto& frames = animation.frames;
+    auto results = std::vector<Result>(frame_batch_size);
+    for (auto begin = size_t{ }; begin < frames.size(); begin += frame_batch_size) {
+      const auto count = std::min(frame_batch_size, frames.size() - begin);
+      scheduler.for_each_parallel([&](size_t index) {
+        results[index] = map(animation.get_frame_image(frames[begin + index]));
+      }, count);
+      for (auto i = size_t{ }; i < count; ++i)
+        reduce(frames[begin + i], std::move(results[i]));
+    }
+  }
+
+  int index_of_closest_palette_color(const Palette& palette,
+      const RGBA& color, bool match_alpha) {
     auto min_index = 0;
     auto min_distance = std::numeric_limits<int>::max();
     for (auto i = 0u; i < palette.size(); ++i) {
       const auto r = palette[i].r - color.r;
       const auto g = palette[i].g - color.g;
       const auto b = palette[i].b - color.b;
-      const auto distance = (r * r + g * g + b * b);
+      const auto a = (match_alpha ? palette[i].a - color.a : 0);
+      const auto distance = (r * r + g * g + b * b + a * a);
       if (distance < min_distance) {
         min_index = to_int(i);
         min_distance = distance;
@@ -277,54 +712,736 @@ namespace {
     return min_index;
   }
 
-  const RGBA& closest_palette_color(const Palette& palette, const RGBA& color) {
-    return palette[to_unsigned(index_of_closest_palette_color(palette, color))];
+  // k-means refinement of the palette, moving each color to the
+  // average of the histogram colors, which are closest to it
+  const auto palette_refinements = 4;
+
+  void refine_palette(Palette& palette, const std::vector<ColorCount>& colors,
+      bool match_alpha) {
+    if (palette.empty())
+      return;
+    const auto max_threads = size_t{ 8 };
+    using Sums = std::vector<std::array<uint64_t, 5>>;
+    for (auto i = 0; i < palette_refinements; ++i) {
+      const auto threads = std::min(max_threads, colors.size() / 1024 + 1);
+      auto thread_sums = std::vector<Sums>(threads, Sums(palette.size()));
+      scheduler.for_each_parallel([&](size_t thread) {
+        auto& sums = thread_sums[thread];
+        const auto begin = colors.size() * thread / threads;
+        const auto end = colors.size() * (thread + 1) / threads;
+        for (auto j = begin; j < end; ++j) {
+          const auto& [color, count] = colors[j];
+          auto& sum = sums[to_unsigned(
+            index_of_closest_palette_color(palette, color, match_alpha))];
+          for (auto c = size_t{ }; c < 4; ++c)
+            sum[c] += uint64_t{ color.channel(to_int(c)) } * count;
+          sum[4] += count;
+        }
+      }, threads);
+
+      auto changed = false;
+      for (auto j = size_t{ }; j < palette.size(); ++j) {
+        auto sum = std::array<uint64_t, 5>{ };
+        for (const auto& sums : thread_sums)
+          for (auto c = size_t{ }; c < 5; ++c)
+            sum[c] += sums[j][c];
+        if (!sum[4])
+          continue;
+        auto color = RGBA{ };
+        for (auto c = size_t{ }; c < 4; ++c)
+          color.channel(to_int(c)) = static_cast<uint8_t>(
+            (sum[c] + sum[4] / 2) / sum[4]);
+        changed |= (color != palette[j]);
+        palette[j] = color;
+      }
+      if (!changed)
+        break;
+    }
+  }
+
+  Palette generate_palette(const ColorHistogram& histogram, int count,
+      bool match_alpha = false) {
+    auto colors = histogram.colors();
+    auto palette = median_cut_reduction(colors, count);
+    refine_palette(palette, colors, match_alpha);
+    return palette;
+  }
+
+  // inverse colormap, a cube of 32x32x32 cells, each listing the palette
+  // colors which can be the closest to a color within the cell,
+  // when matching alpha there is a cube for each of 8 alpha ranges
+  class PaletteLookup {
+  public:
+    explicit PaletteLookup(const Palette& palette, bool match_alpha = false)
+      : m_palette(palette),
+        m_alpha_cells(match_alpha ? alpha_cells : 1) {
+      if (palette.empty() || palette.size() > 256)
+        throw std::invalid_argument("invalid palette size");
+
+      // slabs of cells with the same alpha and red are filled in parallel
+      const auto slab_count = m_alpha_cells * cells_per_channel;
+      auto slabs = std::vector<std::vector<uint8_t>>(slab_count);
+      auto slab_offsets = std::vector<std::vector<uint32_t>>(slab_count);
+      scheduler.for_each_parallel([&](size_t slab) {
+        auto& candidates = slabs[slab];
+        auto& offsets = slab_offsets[slab];
+        const auto a = slab / cells_per_channel;
+        const auto r = slab % cells_per_channel;
+        for (auto g = size_t{ }; g < cells_per_channel; ++g)
+          for (auto b = size_t{ }; b < cells_per_channel; ++b) {
+            offsets.push_back(static_cast<uint32_t>(candidates.size()));
+            add_candidates(a, r, g, b, candidates);
+          }
+      }, slab_count);
+
+      m_offsets.reserve(slab_count * cells_per_channel * cells_per_channel + 1);
+      for (auto slab = size_t{ }; slab < slab_count; ++slab) {
+        const auto base = static_cast<uint32_t>(m_candidates.size());
+        for (auto offset : slab_offsets[slab])
+          m_offsets.push_back(base + offset);
+        m_candidates.insert(m_candidates.end(), slabs[slab].begin(), slabs[slab].end());
+      }
+      m_offsets.push_back(static_cast<uint32_t>(m_candidates.size()));
+    }
+
+    const Palette& palette() const { return m_palette; }
+
+    // same result as a linear search for the closest color
+    int index_of_closest(const RGBA& color) const {
+      const auto match_alpha = (m_alpha_cells > 1);
+      const auto cell = (match_alpha ? (size_t{ color.a } >> alpha_shift) : 0) *
+                          cells_per_channel * cells_per_channel * cells_per_channel +
+                        (size_t{ color.r } >> cell_shift) * cells_per_channel * cells_per_channel +
+                        (size_t{ color.g } >> cell_shift) * cells_per_channel +
+                        (size_t{ color.b } >> cell_shift);
+      auto min_index = 0;
+      auto min_distance = std::numeric_limits<int>::max();
+      for (auto i = m_offsets[cell]; i < m_offsets[cell + 1]; ++i) {
+        const auto index = m_candidates[i];
+        const auto& entry = m_palette[index];
+        const auto r = entry.r - color.r;
+        const auto g = entry.g - color.g;
+        const auto b = entry.b - color.b;
+        const auto a = (match_alpha ? entry.a - color.a : 0);
+        const auto distance = (r * r + g * g + b * b + a * a);
+        if (distance < min_distance) {
+          min_index = index;
+          min_distance = distance;
+        }
+      }
+      return min_index;
+    }
+
+  private:
+    static constexpr auto cell_shift = 3;
+    static constexpr auto cells_per_channel = size_t{ 256 >> cell_shift };
+    static constexpr auto alpha_shift = 5;
+    static constexpr auto alpha_cells = size_t{ 256 >> alpha_shift };
+
+    // a color is a candidate when its minimum distance to the cell is not
+    // greater than the smallest maximum distance of any color to the cell
+    void add_candidates(size_t a, size_t r, size_t g, size_t b,
+        std::vector<uint8_t>& candidates) const {
+      const auto cell = std::array<int, 4>{
+        to_int(r << cell_shift), to_int(g << cell_shift),
+        to_int(b << cell_shift), to_int(a << alpha_shift) };
+      const auto sizes = std::array<int, 4>{
+        (1 << cell_shift) - 1, (1 << cell_shift) - 1,
+        (1 << cell_shift) - 1, (1 << alpha_shift) - 1 };
+      const auto channels = size_t{ m_alpha_cells > 1 ? 4u : 3u };
+      auto min_distances = std::array<int, 256>();
+      auto bound = std::numeric_limits<int>::max();
+      for (auto i = size_t{ }; i < m_palette.size(); ++i) {
+        auto min_distance = 0;
+        auto max_distance = 0;
+        for (auto c = size_t{ }; c < channels; ++c) {
+          const auto value = int{ m_palette[i].channel(to_int(c)) };
+          const auto low = cell[c];
+          const auto high = cell[c] + sizes[c];
+          const auto outside = (value < low ? low - value :
+                                value > high ? value - high : 0);
+          const auto farthest = std::max(std::abs(value - low), std::abs(value - high));
+          min_distance += outside * outside;
+          max_distance += farthest * farthest;
+        }
+        min_distances[i] = min_distance;
+        bound = std::min(bound, max_distance);
+      }
+      for (auto i = size_t{ }; i < m_palette.size(); ++i)
+        if (min_distances[i] <= bound)
+          candidates.push_back(static_cast<uint8_t>(i));
+    }
+
+    const Palette& m_palette;
+    const size_t m_alpha_cells;
+    std::vector<uint32_t> m_offsets;
+    std::vector<uint8_t> m_candidates;
+  };
+
+  uint8_t saturate(int value) {
+    return to_byte(std::clamp(value, 0, 255));
+  }
+
+  const auto row_band_size = 64;
+
+  // calls function with bands of rows in parallel
+  template<typename F> // F(int y0, int y1)
+  void for_each_row_band(int height, F&& function) {
+    scheduler.for_each_parallel([&](size_t index) {
+      const auto y = to_int(index) * row_band_size;
+      function(y, std::min(y + row_band_size, height));
+    }, static_cast<size_t>(div_ceil(height, row_band_size)));
   }
 
   // https://en.wikipedia.org/wiki/Floyd%E2%80%93Steinberg_dithering
-  Image floyd_steinberg_dithering(Image image, const Palette& palette) {
-    const auto diff = [](const uint8_t& a, const uint8_t& b) { 
-      return static_cast<int>(a) - static_cast<int>(b);
+  // rows of large images are processed concurrently as a wavefront,
+  // each row following the previous row, from which it receives errors
+  const auto wavefront_min_pixels = 1 << 16;
+  const auto wavefront_progress_step = 32;
+  const auto wavefront_max_rows = 64;
+
+  MonoImage floyd_steinberg_dithering(const ImageView& image, const PaletteLookup& lookup) {
+    const auto& palette = lookup.palette();
+    const auto [x0, y0, w, h] = image.bounds();
+    auto output = MonoImage(w, h);
+
+    // errors (times 16) diffused to a row, a row's buffer is reused as soon
+    // as the row is done. errors diffused past the left and right edges are
+    // added to the edge pixels, those past the last row to the next pixel
+    using Error = std::array<int, 3>;
+    const auto ring_size = std::min(h + 1, wavefront_max_rows);
+    auto errors = std::vector<std::vector<Error>>(to_unsigned(ring_size),
+      std::vector<Error>(to_unsigned(w)));
+    auto progress = std::make_unique<std::atomic<int>[]>(to_unsigned(h));
+    for (auto y = 0; y < h; ++y)
+      progress[to_unsigned(y)].store(0);
+
+    // waiting rows block, the signal is only sent when a row is waiting
+    auto progress_mutex = std::mutex();
+    auto progress_signal = std::condition_variable();
+    auto waiting = std::atomic<int>();
+    const auto set_progress = [&](int y, int x) {
+      progress[to_unsigned(y)].store(x);
+      if (waiting.load() > 0) {
+        auto lock = std::lock_guard(progress_mutex);
+        progress_signal.notify_all();
+      }
     };
-    const auto saturate = [](int value) { 
-      return to_byte(std::clamp(value, 0, 255));
+    const auto wait_for_progress = [&](int y, int x) {
+      auto current = progress[to_unsigned(y)].load();
+      if (current < x) {
+        auto lock = std::unique_lock(progress_mutex);
+        waiting.fetch_add(1);
+        progress_signal.wait(lock, [&]() {
+          current = progress[to_unsigned(y)].load();
+          return (current >= x);
+        });
+        waiting.fetch_sub(1);
+      }
+      return current;
     };
-    const auto w = image.width();
-    const auto h = image.height();
-    for (auto y = 0; y < h; ++y)
+
+    const auto dither_row = [&](int y) {
+      if (y + 1 >= ring_size)
+        wait_for_progress(y + 1 - ring_size, w);
+      const auto& incoming = errors[to_unsigned(y % ring_size)];
+      auto& outgoing = errors[to_unsigned((y + 1) % ring_size)];
+      std::fill(outgoing.begin(), outgoing.end(), Error{ });
+
+      const auto row = image.row(y0 + y) + x0;
+      auto dest = output.data() + y * w;
+      auto previous_progress = (y > 0 ? 0 : w);
+      const auto last_row = (y == h - 1);
+      auto carry = Error{ };
       for (auto x = 0; x < w; ++x) {
-        auto& color = image.rgba_at({ x, y });
-        const auto old_color = color;
-        color = closest_palette_color(palette, color);
-        const auto error_r = diff(old_color.r, color.r);
-        const auto error_g = diff(old_color.g, color.g);
-        const auto error_b = diff(old_color.b, color.b);
-        const auto apply_error = [&](int x, int y, int fs) {
-          auto& color = image.rgba_at({ 
-            std::clamp(x, 0, w - 1), std::clamp(y, 0, h - 1)
-          });
-          color.r = saturate(color.r + error_r * fs / 16);
-          color.g = saturate(color.g + error_g * fs / 16);
-          color.b = saturate(color.b + error_b * fs / 16);
-        };
-        apply_error(x + 1, y,     7);
-        apply_error(x - 1, y + 1, 3);
-        apply_error(x    , y + 1, 5);
-        apply_error(x + 1, y + 1, 1);
+        // the incoming error is complete when the previous row is ahead
+        if (previous_progress < std::min(x + 2, w))
+          previous_progress = wait_for_progress(y - 1, std::min(x + 2, w));
+
+        const auto i = to_unsigned(x);
+        auto color = row[x];
+        for (auto c = 0u; c < 3; ++c)
+          color.channel(to_int(c)) = saturate(color.channel(to_int(c)) +
+            (incoming[i][c] + carry[c]) / 16);
+
+        const auto index = lookup.index_of_closest(color);
+        dest[x] = to_byte(index);
+
+        const auto& closest = palette[to_unsigned(index)];
+        for (auto c = 0u; c < 3; ++c) {
+          const auto error = color.channel(to_int(c)) - closest.channel(to_int(c));
+          carry[c] = error * (last_row ? 8 : 7);
+          outgoing[x > 0 ? i - 1 : i][c] += error * 3;
+          outgoing[i][c] += error * 5;
+          outgoing[x + 1 < w ? i + 1 : i][c] += error * 1;
+        }
+        if ((x + 1) % wavefront_progress_step == 0)
+          set_progress(y, x + 1);
       }
-    return image;
+      set_progress(y, w);
+    };
+
+    // rows are started in order, so the awaited rows are always running
+    if (w * h < wavefront_min_pixels) {
+      for (auto y = 0; y < h; ++y)
+        dither_row(y);
+    }
+    else {
+      scheduler.for_each_parallel([&](size_t y) { dither_row(to_int(y)); },
+        static_cast<size_t>(h));
+    }
+    return output;
+  }
+
+  // https://en.wikipedia.org/wiki/Ordered_dithering
+  MonoImage ordered_dithering(const ImageView& image, const PaletteLookup& lookup) {
+    static constexpr auto bayer_matrix = std::array<uint8_t, 64>{
+       0, 32,  8, 40,  2, 34, 10, 42,
+      48, 16, 56, 24, 50, 18, 58, 26,
+      12, 44,  4, 36, 14, 46,  6, 38,
+      60, 28, 52, 20, 62, 30, 54, 22,
+       3, 35, 11, 43,  1, 33,  9, 41,
+      51, 19, 59, 27, 49, 17, 57, 25,
+      15, 47,  7, 39, 13, 45,  5, 37,
+      63, 31, 55, 23, 61, 29, 53, 21,
+    };
+    // about the distance between palette colors, when evenly distributed
+    const auto levels = std::cbrt(to_real(lookup.palette().size()));
+    const auto spread = to_int(255 / std::max(levels - 1, real{ 1 }));
+    const auto [x0, y0, w, h] = image.bounds();
+    auto output = MonoImage(w, h);
+    for_each_row_band(h, [&](int begin, int end) {
+      for (auto y = begin; y < end; ++y) {
+        const auto row = image.row(y0 + y) + x0;
+        const auto thresholds = &bayer_matrix[to_unsigned(y % 8) * 8];
+        auto dest = output.data() + y * w;
+        for (auto x = 0; x < w; ++x) {
+          const auto offset = (thresholds[x % 8] * 2 - 63) * spread / 128;
+          auto color = row[x];
+          for (auto c = 0; c < 3; ++c)
+            color.channel(c) = saturate(color.channel(c) + offset);
+          dest[x] = to_byte(lookup.index_of_closest(color));
+        }
+      }
+    });
+    return output;
+  }
+
+  MonoImage quantize_image(const ImageView& image, const PaletteLookup& lookup, Dither dither) {
+    switch (dither) {
+      case Dither::floyd_steinberg: return floyd_steinberg_dithering(image, lookup);
+      case Dither::ordered: return ordered_dithering(image, lookup);
+      case Dither::none: break;
+    }
+    const auto [x0, y0, w, h] = image.bounds();
+    auto output = MonoImage(w, h);
+    for_each_row_band(h, [&](int begin, int end) {
+      for (auto y = begin; y < end; ++y) {
+        const auto row = image.row(y0 + y) + x0;
+        auto dest = output.data() + y * w;
+        for (auto x = 0; x < w; ++x)
+          dest[x] = to_byte(lookup.index_of_closest(row[x]));
+      }
+    });
+    return output;
+  }
+
+  // the colors of the image, unless there are more than max_count,
+  // translucent colors come first, so the PNG tRNS chunk stays short
+  std::optional<Palette> get_unique_colors(const ImageView& image, size_t max_count) {
+    const auto [x0, y0, w, h] = image.bounds();
+    if (w <= 0 || h <= 0)
+      return Palette();
+    auto band_colors = std::vector<std::unordered_set<uint32_t>>(
+      static_cast<size_t>(div_ceil(h, row_band_size)));
+    auto exceeded = std::atomic<bool>();
+    for_each_row_band(h, [&](int begin, int end) {
+      auto& colors = band_colors[to_unsigned(begin / row_band_size)];
+      for (auto y = begin; y < end && !exceeded.load(std::memory_order_relaxed); ++y) {
+        const auto row = image.row(y0 + y) + x0;
+        for (auto x = 0; x < w; ++x)
+          if (x == 0 || row[x] != row[x - 1])
+            colors.insert(row[x].rgba);
+        if (colors.size() > max_count)
+          exceeded.store(true, std::memory_order_relaxed);
+      }
+    });
+    if (exceeded)
+      return std::nullopt;
+
+    auto colors = std::move(band_colors.front());
+    for (auto i = size_t{ 1 }; i < band_colors.size(); ++i) {
+      colors.merge(band_colors[i]);
+      if (colors.size() > max_count)
+        return std::nullopt;
+    }
+    auto palette = Palette();
+    for (auto color : colors) {
+      auto& entry = palette.emplace_back();
+      entry.rgba = color;
+    }
+    std::sort(palette.begin(), palette.end(),
+      [](const RGBA& a, const RGBA& b) {
+        return std::tie(a.a, a.rgba) < std::tie(b.a, b.rgba);
+      });
+    return palette;
+  }
+
+  MonoImage index_image(const ImageView& image, const Palette& palette) {
+    auto indices = std::unordered_map<uint32_t, uint8_t>();
+    for (auto i = size_t{ }; i < palette.size(); ++i)
+      indices[palette[i].rgba] = static_cast<uint8_t>(i);
+
+    const auto [x0, y0, w, h] = image.bounds();
+    auto output = MonoImage(w, h);
+    for_each_row_band(h, [&](int begin, int end) {
+      for (auto y = begin; y < end; ++y) {
+        const auto row = image.row(y0 + y) + x0;
+        auto dest = output.data() + y * w;
+        for (auto x = 0; x < w; ++x)
+          dest[x] = (x > 0 && row[x] == row[x - 1] ? dest[x - 1] :
+            indices.find(row[x].rgba)->second);
+      }
+    });
+    return output;
+  }
+
+  // translucent entries close to opaque are made opaque,
+  // so opaque areas do not become slightly transparent
+  const auto min_translucent_alpha = 248;
+
+  // fully transparent pixels get the first entry,
+  // the others are quantized by their color and alpha
+  MonoImage quantize_visible(const ImageView& image, int max_colors,
+      Dither dither, Palette& palette) {
+    auto histogram = ColorHistogram();
+    histogram.add(image, true);
+    const auto [x0, y0, w, h] = image.bounds();
+    auto transparent = false;
+    for (auto y = 0; y < h && !transparent; ++y)
+      transparent = std::any_of(image.row(y0 + y) + x0, image.row(y0 + y) + x0 + w,
+        [](const RGBA& color) { return color.a == 0; });
+
+    auto visible = generate_palette(histogram,
+      max_colors - (transparent ? 1 : 0), true);
+    for (auto& color : visible)
+      if (color.a >= min_translucent_alpha)
+        color.a = 255;
+    std::stable_partition(visible.begin(), visible.end(),
+      [](const RGBA& color) { return color.a != 255; });
+    palette.clear();
+    if (transparent)
+      palette.push_back(RGBA{ });
+    palette.insert(palette.end(), visible.begin(), visible.end());
+    if (visible.empty())
+      return MonoImage(w, h, 0);
+
+    auto output = quantize_image(image, PaletteLookup(visible, true), dither);
+    if (transparent)
+      for_each_row_band(h, [&](int begin, int end) {
+        for (auto y = begin; y < end; ++y) {
+          const auto row = image.row(y0 + y) + x0;
+          auto dest = output.data() + y * w;
+          for (auto x = 0; x < w; ++x)
+            dest[x] = (row[x].a ? to_byte(dest[x] + 1) : 0);
+        }
+      });
+    return output;
+  }
+
+  const auto png_band_size = size_t{ 1 } << 17;
+
+  uint8_t paeth_predictor(int a, int b, int c) {
+    const auto p = a + b - c;
+    const auto pa = std::abs(p - a);
+    const auto pb = std::abs(p - b);
+    const auto pc = std::abs(p - c);
+    return to_byte(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+  }
+
+  // https://www.w3.org/TR/png/#9Filters
+  void filter_png_row(int type, const uint8_t* row, const uint8_t* previous,
+      size_t size, size_t bytes_per_pixel, uint8_t* output) {
+    for (auto i = size_t{ }; i < size; ++i) {
+      const auto a = (i >= bytes_per_pixel ? int{ row[i - bytes_per_pixel] } : 0);
+      const auto b = int{ previous[i] };
+      const auto c = (i >= bytes_per_pixel ? int{ previous[i - bytes_per_pixel] } : 0);
+      const auto prediction = (type == 1 ? a : type == 2 ? b :
+        type == 3 ? (a + b) / 2 : type == 4 ? paeth_predictor(a, b, c) : 0);
+      output[i] = static_cast<uint8_t>(row[i] - prediction);
+    }
+  }
+
+  // filter type with the minimum sum of absolute differences
+  int filter_png_row(const uint8_t* row, const uint8_t* previous,
+      size_t size, size_t bytes_per_pixel, uint8_t* output) {
+    auto best_type = 0;
+    auto best_sum = std::numeric_limits<int64_t>::max();
+    for (auto type = 0; type < 5; ++type) {
+      filter_png_row(type, row, previous, size, bytes_per_pixel, output);
+      auto sum = int64_t{ };
+      for (auto i = size_t{ }; i < size; ++i)
+        sum += std::abs(int{ static_cast<int8_t>(output[i]) });
+      if (sum < best_sum) {
+        best_sum = sum;
+        best_type = type;
+      }
+    }
+    filter_png_row(best_type, row, previous, size, bytes_per_pixel, output);
+    return best_type;
+  }
+
+  // https://github.com/madler/zlib/blob/master/adler32.c
+  mz_ulong combine_adler32(mz_ulong adler1, mz_ulong adler2, size_t length2) {
+    const auto base = mz_ulong{ 65521 };
+    const auto remainder = static_cast<mz_ulong>(length2 % base);
+    auto sum1 = adler1 & 0xFFFF;
+    auto sum2 = (remainder * sum1) % base;
+    sum1 += (adler2 & 0xFFFF) + base - 1;
+    sum2 += ((adler1 >> 16) & 0xFFFF) + ((adler2 >> 16) & 0xFFFF) + base - remainder;
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= 2 * base) sum2 -= 2 * base;
+    if (sum2 >= base) sum2 -= base;
+    return sum1 | (sum2 << 16);
+  }
+
+  struct PngBand {
+    std::vector<uint8_t> compressed;
+    mz_ulong adler;
+    size_t length;
+  };
+
+  // Bands of rows are filtered and deflated concurrently. All but the
+  // last band end with a sync flush, so the raw deflate streams can be
+  // concatenated to one zlib stream, like pigz does.
+  std::optional<std::vector<uint8_t>> compress_png_rows(int height,
+      size_t row_size, size_t bytes_per_pixel, bool filter,
+      const std::function<void(int, uint8_t*)>& get_row) {
+    const auto band_rows = to_int(std::max(png_band_size / (row_size + 1), size_t{ 1 }));
+    auto bands = std::vector<PngBand>(static_cast<size_t>(div_ceil(height, band_rows)));
+    auto failed = std::atomic<bool>();
+    scheduler.for_each_parallel([&](size_t index) {
+      const auto begin = to_int(index) * band_rows;
+      const auto end = std::min(begin + band_rows, height);
+      auto rows = std::vector<uint8_t>((row_size + 1) * to_unsigned(end - begin));
+      auto previous = std::vector<uint8_t>(row_size);
+      auto current = std::vector<uint8_t>(row_size);
+      if (filter && begin > 0)
+        get_row(begin - 1, previous.data());
+      for (auto y = begin; y < end; ++y) {
+        const auto dest = rows.data() + (row_size + 1) * to_unsigned(y - begin);
+        if (filter) {
+          get_row(y, current.data());
+          dest[0] = to_byte(filter_png_row(current.data(), previous.data(),
+            row_size, bytes_per_pixel, dest + 1));
+          std::swap(previous, current);
+        }
+        else {
+          dest[0] = 0;
+          get_row(y, dest + 1);
+        }
+      }
+
+      auto& band = bands[index];
+      band.length = rows.size();
+      band.adler = mz_adler32(MZ_ADLER32_INIT, rows.data(), rows.size());
+      auto stream = mz_stream{ };
+      if (mz_deflateInit2(&stream, stbi_write_png_compression_level, MZ_DEFLATED,
+            -MZ_DEFAULT_WINDOW_BITS, 9, MZ_DEFAULT_STRATEGY) != MZ_OK) {
+        failed = true;
+        return;
+      }
+      // the bound does not include the sync flush marker
+      band.compressed.resize(mz_deflateBound(&stream,
+        static_cast<mz_ulong>(rows.size())) + 16);
+      stream.next_in = rows.data();
+      stream.avail_in = static_cast<unsigned int>(rows.size());
+      stream.next_out = band.compressed.data();
+      stream.avail_out = static_cast<unsigned int>(band.compressed.size());
+      const auto last = (index == bands.size() - 1);
+      const auto result = mz_deflate(&stream, last ? MZ_FINISH : MZ_SYNC_FLUSH);
+      if ((last ? result != MZ_STREAM_END : result != MZ_OK) || stream.avail_in)
+        failed = true;
+      band.compressed.resize(stream.total_out);
+      mz_deflateEnd(&stream);
+    }, bands.size());
+    if (failed)
+      return std::nullopt;
+
+    // zlib header, bands and checksum of all rows
+    auto output = std::vector<uint8_t>{ 0x78, 0xDA };
+    auto adler = mz_ulong{ MZ_ADLER32_INIT };
+    for (const auto& band : bands) {
+      output.insert(output.end(), band.compressed.begin(), band.compressed.end());
+      adler = combine_adler32(adler, band.adler, band.length);
+    }
+    for (auto shift : { 24, 16, 8, 0 })
+      output.push_back(static_cast<uint8_t>(adler >> shift));
+    return output;
+  }
+
+  void write_png_chunk(std::ostream& os, const char* type,
+      const uint8_t* data, size_t size) {
+    const auto write_uint32 = [&](mz_ulong value) {
+      const uint8_t bytes[] = { static_cast<uint8_t>(value >> 24),
+        static_cast<uint8_t>(value >> 16), static_cast<uint8_t>(value >> 8),
+        static_cast<uint8_t>(value) };
+      os.write(reinterpret_cast<const char*>(bytes), 4);
+    };
+    write_uint32(size);
+    os.write(type, 4);
+    os.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+    auto crc = mz_crc32(MZ_CRC32_INIT, reinterpret_cast<const uint8_t*>(type), 4);
+    crc = mz_crc32(crc, data, size);
+    write_uint32(crc);
+  }
+
+  // https://www.w3.org/TR/png/
+  bool write_png(const std::filesystem::path& filename, int width, int height,
+      int bit_depth, int color_type, const std::vector<uint8_t>& compressed,
+      const Palette* palette) {
+    const auto to_bytes = [](int value) {
+      return std::array<uint8_t, 4>{ static_cast<uint8_t>(value >> 24),
+        static_cast<uint8_t>(value >> 16), static_cast<uint8_t>(value >> 8),
+        static_cast<uint8_t>(value) };
+    };
+    auto header = std::vector<uint8_t>();
+    for (auto value : { width, height })
+      for (auto byte : to_bytes(value))
+        header.push_back(byte);
+    // bit depth, color type, compression, filter, interlace
+    header.insert(header.end(), { static_cast<uint8_t>(bit_depth),
+      static_cast<uint8_t>(color_type), 0, 0, 0 });
+
+    auto file = std::ofstream(filename, std::ios::binary);
+    file.write("\x89PNG\r\n\x1A\n", 8);
+    write_png_chunk(file, "IHDR", header.data(), header.size());
+    if (palette) {
+      auto colors = std::vector<uint8_t>();
+      auto alphas = std::vector<uint8_t>();
+      for (const auto& color : *palette) {
+        colors.insert(colors.end(), { color.r, color.g, color.b });
+        if (color.a != 255)
+          alphas.resize(colors.size() / 3, 255);
+      }
+      for (auto i = size_t{ }; i < alphas.size(); ++i)
+        alphas[i] = (*palette)[i].a;
+      write_png_chunk(file, "PLTE", colors.data(), colors.size());
+      if (!alphas.empty())
+        write_png_chunk(file, "tRNS", alphas.data(), alphas.size());
+    }
+    write_png_chunk(file, "IDAT", compressed.data(), compressed.size());
+    write_png_chunk(file, "IEND", nullptr, 0);
+    file.close();
+    return !file.fail();
+  }
+
+  bool write_png_rgba(const std::filesystem::path& filename, const Image& image) {
+    const auto [width, height] = image.bounds().size();
+    const auto row_size = to_unsigned(width) * sizeof(RGBA);
+    const auto compressed = compress_png_rows(height, row_size, sizeof(RGBA), true,
+      [&](int y, uint8_t* row) {
+        std::memcpy(row, image.rgba() + y * width, row_size);
+      });
+    // color type truecolor with alpha
+    return compressed && write_png(filename, width, height, 8, 6, *compressed, nullptr);
+  }
+
+  // packs up to 16 colors into fewer bits, indexed rows are not filtered
+  bool write_png_indexed(const std::filesystem::path& filename,
+      const MonoImage& image, const Palette& palette) {
+    const auto [width, height] = image.bounds().size();
+    const auto bit_depth = (palette.size() <= 2 ? 1 : palette.size() <= 4 ? 2 :
+      palette.size() <= 16 ? 4 : 8);
+    const auto row_size = to_unsigned((width * bit_depth + 7) / 8);
+    const auto compressed = compress_png_rows(height, row_size, 1, false,
+      [&](int y, uint8_t* row) {
+        const auto source = image.data() + y * width;
+        if (bit_depth == 8) {
+          std::memcpy(row, source, row_size);
+          return;
+        }
+        std::memset(row, 0, row_size);
+        const auto per_byte = 8 / bit_depth;
+        for (auto x = 0; x < width; ++x)
+          row[x / per_byte] |= static_cast<uint8_t>(
+            source[x] << (8 - bit_depth * (x % per_byte + 1)));
+      });
+    // color type indexed
+    return compressed && write_png(filename, width, height, bit_depth, 3,
+      *compressed, &palette);
+  }
+
+  // writes a palette-indexed PNG, when the colors fit into a palette
+  bool try_write_png_indexed(const std::filesystem::path& filename,
+      const Image& image, int max_colors, Dither dither) {
+    if (image.width() <= 0 || image.height() <= 0)
+      return false;
+    const auto limit = (max_colors > 0 ? std::min(max_colors, 256) : 256);
+    if (auto palette = get_unique_colors(image, to_unsigned(limit)))
+      return write_png_indexed(filename, index_image(image, *palette), *palette);
+    if (max_colors <= 0)
+      return false;
+    auto palette = Palette();
+    const auto indices = quantize_visible(image, limit, dither, palette);
+    return write_png_indexed(filename, indices, palette);
+  }
+
+  // bounds of the values which differ from the previous image
+  // or from the transparent index, when there is no previous image
+  std::optional<Rect> get_changed_bounds(const MonoImage& image,
+      const MonoImage* previous, uint8_t transparent_index) {
+    const auto [width, height] = image.bounds().size();
+    auto x0 = width, y0 = height, x1 = -1, y1 = -1;
+    for (auto y = 0; y < height; ++y) {
+      const auto row = image.data() + y * width;
+      const auto previous_row = (previous ? previous->data() + y * width : nullptr);
+      for (auto x = 0; x < width; ++x)
+        if (previous_row ? row[x] != previous_row[x] : row[x] != transparent_index) {
+          x0 = std::min(x0, x);
+          x1 = std::max(x1, x);
+          y0 = std::min(y0, y);
+          y1 = y;
+        }
+    }
+    if (x1 < 0)
+      return std::nullopt;
+    return Rect{ x0, y0, x1 - x0 + 1, y1 - y0 + 1 };
+  }
+
+  // rect of a frame, with the values of unchanged pixels replaced
+  struct GifFrame {
+    Rect rect;
+    std::vector<uint8_t> values;
+    real duration;
+  };
+
+  uint16_t get_gif_delay(real duration) {
+    return std::chrono::duration_cast<
+      std::chrono::duration<uint16_t, std::ratio<1, 100>>>(
+      std::chrono::duration<real>(duration)).count();
   }
 
   // https://giflib.sourceforge.net/whatsinagif/
+  // Without a color key, only the rect which changed since the previous
+  // frame is written, with unchanged pixels being transparent. Otherwise
+  // each frame replaces the previous one and only its visible rect is written.
+  // Identical consecutive frames are merged. The LZW encoding of a batch
+  // of frames runs concurrently, the frames are written in order.
   bool write_gif(const std::string& filename, const Animation& animation) {
     if (animation.frames.empty())
       return false;
-    const auto& first_image = animation.frames.front().image;
 
-    const auto palette = generate_palette(animation, 
-      (animation.max_colors ? std::min(animation.max_colors, 256) : 256));
+    // without a color key, one index is kept for the unchanged pixels
+    const auto delta_frames = !animation.color_key.has_value();
+    const auto max_colors = std::min(
+      (animation.max_colors ? animation.max_colors : 256),
+      (delta_frames ? 255 : 256));
+    const auto palette = generate_palette(animation, max_colors);
+    const auto color_count = palette.size() + (delta_frames ? 1 : 0);
     auto bits = 0;
-    for (auto c = palette.size() - 1; c; c >>= 1)
+    for (auto c = color_count - 1; c; c >>= 1)
       ++bits;
     auto palette_rgb = std::make_unique<uint8_t[]>((1 << bits) * 3);
     auto pos = palette_rgb.get();
@@ -334,32 +1451,90 @@ namespace {
       *pos++ = color.b;
     }
 
-    auto transparent_index = -1;
-    if (animation.color_key)
-      transparent_index = index_of_closest_palette_color(
-        palette, *animation.color_key);
+    // the lookup is shared by all frames
+    const auto lookup = PaletteLookup(palette);
+    const auto transparent_index = to_byte(delta_frames ? 
+      to_int(palette.size()) : lookup.index_of_closest(*animation.color_key));
+    const auto disposal = (delta_frames ? 1 : 2);
+
+    // the size is known once the first frame was composed
+    auto gif = std::unique_ptr<ge_GIF, decltype(&ge_close_gif)>(
+      nullptr, &ge_close_gif);
+    auto failed = false;
+
+    // the last frame's duration increases while the following frames
+    // do not differ, all others are complete
+    auto previous = MonoImage();
+    auto frames = std::vector<GifFrame>();
+    const auto write_frames = [&]() {
+      auto buffers = std::vector<ge_Buffer>(frames.size());
+      scheduler.for_each_parallel([&](size_t index) {
+        const auto& frame = frames[index];
+        const auto [x, y, w, h] = frame.rect;
+        ge_encode_frame(gif.get(), &buffers[index], frame.values.data(), w,
+          get_gif_delay(frame.duration), disposal, transparent_index,
+          static_cast<uint16_t>(x), static_cast<uint16_t>(y),
+          static_cast<uint16_t>(w), static_cast<uint16_t>(h));
+      }, frames.size());
+      for (auto& buffer : buffers) {
+        failed |= (buffer.failed != 0);
+        ge_write_frame(gif.get(), &buffer);
+        ge_free_buffer(&buffer);
+      }
+      frames.clear();
+    };
 
-    const auto [width, height] = first_image.bounds().size();
-    if (width > 0xFFFF || height > 0xFFFF)
-      return false;
+    for_each_frame(animation,
+      [&](Image image) {
+        return quantize_image(image, lookup, animation.dither);
+      },
+      [&](const Animation::Frame& frame, MonoImage mono) {
+        const auto [width, height] = mono.bounds().size();
+        if (!gif && !failed && width <= 0xFFFF && height <= 0xFFFF)
+          gif.reset(ge_new_gif(filename.c_str(),
+            static_cast<uint16_t>(width),
+            static_cast<uint16_t>(height),
+            palette_rgb.get(), bits, transparent_index, animation.loop_count));
+        if (failed || !gif || gif->w != width || gif->h != height) {
+          failed = true;
+          return;
+        }
 
-    auto gif = ge_new_gif(filename.c_str(),
-      static_cast<uint16_t>(width),
-      static_cast<uint16_t>(height),
-      palette_rgb.get(), bits, transparent_index, animation.loop_count);
-    if (!gif)
-      return false;
+        const auto size = to_unsigned(width * height);
+        if (previous && std::memcmp(previous.data(), mono.data(), size) == 0) {
+          frames.back().duration += frame.duration;
+          return;
+        }
+        if (frames.size() >= gif_encode_batch_size)
+          write_frames();
+
+        // the first frame is written completely,
+        // an empty frame still needs a pixel for the delay
+        const auto rect = (!previous ? mono.bounds() :
+          get_changed_bounds(mono, (delta_frames ? &previous : nullptr),
+            transparent_index).value_or(Rect{ 0, 0, 1, 1 }));
+        auto values = std::vector<uint8_t>(to_unsigned(rect.w * rect.h));
+        auto dest = values.data();
+        for (auto y = rect.y; y < rect.y + rect.h; ++y, dest += rect.w) {
+          const auto offset = to_unsigned(y * width + rect.x);
+          const auto source = mono.data() + offset;
+          if (delta_frames && previous) {
+            const auto previous_row = previous.data() + offset;
+            for (auto x = 0; x < rect.w; ++x)
+              dest[x] = (source[x] == previous_row[x] ?
+                transparent_index : source[x]);
+          }
+          else {
+            std::memcpy(dest, source, to_unsigned(rect.w));
+          }
+        }
+        frames.push_back({ rect, std::move(values), frame.duration });
+        previous = std::move(mono);
+      });
 
-    for (const auto& frame : animation.frames) {
-      const auto delay = std::chrono::duration_cast<
-        std::chrono::duration<uint16_t, std::ratio<1, 100>>>(
-        std::chrono::duration<real>(frame.duration)).count();
-      const auto mono = quantize_image(frame.image, palette, true);
-      std::memcpy(gif->frame, mono.data(), to_unsigned(width * height));
-      ge_add_frame(gif, delay);
-    }
-    ge_close_gif(gif);
-    return true;
+    if (!failed)
+      write_frames();
+    return !failed;
   }
 } // namespace
 
@@ -419,7 +1594,8 @@ Image::Image(Image&& rhs)
     m_filename(std::exchange(rhs.m_filename, { })),
     m_data(std::exchange(rhs.m_data, nullptr)),
     m_width(std::exchange(rhs.m_width, 0)),
-    m_height(std::exchange(rhs.m_height, 0)) {
+    m_height(std::exchange(rhs.m_height, 0)),
+    m_used_pixels(std::exchange(rhs.m_used_pixels, { })) {
 }
 
 Image& Image::operator=(Image&& rhs) {
@@ -429,9 +1605,24 @@ Image& Image::operator=(Image&& rhs) {
   std::swap(m_data, tmp.m_data);
   std::swap(m_width, tmp.m_width);
   std::swap(m_height, tmp.m_height);
+  std::swap(m_used_pixels, tmp.m_used_pixels);
   return *this;
 }
 
+const UsedPixels& Image::used_pixels(bool gray_levels, int threshold) const {
+  auto lock = std::lock_guard(m_used_pixels_mutex);
+  for (const auto& used : m_used_pixels)
+    if (used->gray_levels() == gray_levels && used->threshold() == threshold)
+      return *used;
+  return *m_used_pixels.emplace_back(
+    std::make_unique<UsedPixels>(*this, gray_levels, threshold));
+}
+
+void Image::clear_used_pixels() {
+  auto lock = std::lock_guard(m_used_pixels_mutex);
+  m_used_pixels.clear();
+}
+
 Image::~Image() {
   stbi_image_free(m_data);
 }
@@ -472,6 +1663,80 @@ MonoImage::~MonoImage() {
   stbi_image_free(m_data);
 }
 
+ImageView::ImageView(const Image& image, const Rect& rect)
+  : ImageView(image.rgba(), image.width(), rect) {
+  check_rect(image, rect);
+}
+
+ImageView ImageView::view(const Rect& rect) const {
+  check_rect(*this, rect);
+  return { m_data, m_stride, rect };
+}
+
+MonoImageView::MonoImageView(const MonoImage& image, const Rect& rect)
+  : MonoImageView(image.data(), image.width(), rect) {
+  check(containing(image.bounds(), rect));
+}
+
+MonoImageView MonoImageView::view(const Rect& rect) const {
+  check(containing(m_bounds, rect));
+  return { m_data, m_stride, rect };
+}
+
+UsedPixels::UsedPixels(const ImageView& image, bool gray_levels, int threshold)
+  : m_gray_levels(gray_levels),
+    m_threshold(threshold),
+    m_bounds(image.bounds()) {
+
+  // first row and column stay zero
+  const auto levels = ChannelView(image, gray_levels);
+  const auto stride = to_unsigned(m_bounds.w + 1);
+  m_sums.resize(stride * to_unsigned(m_bounds.h + 1));
+  auto prev = m_sums.begin();
+  for (auto y = m_bounds.y; y < m_bounds.y1(); ++y) {
+    const auto row = levels.row(y) + m_bounds.x;
+    const auto dest = prev + to_int(stride);
+    auto row_sum = uint32_t{ };
+    for (auto x = 0; x < m_bounds.w; ++x) {
+      row_sum += (levels.value(row[x]) >= threshold ? 1u : 0u);
+      dest[x + 1] = prev[x + 1] + row_sum;
+    }
+    prev = dest;
+  }
+}
+
+int UsedPixels::count(const Rect& rect) const {
+  check(containing(m_bounds, rect));
+  return to_int(sum(rect.x1(), rect.y1()) - sum(rect.x, rect.y1()) -
+    sum(rect.x1(), rect.y) + sum(rect.x, rect.y));
+}
+
+Rect UsedPixels::get_used_bounds(const Rect& rect) const {
+  // same result as scanning, when empty
+  if (is_empty(rect))
+    return { rect.x1() - 1, rect.y1() - 1, 1, 1 };
+
+  // find first count of rows/columns, which is not empty
+  const auto search = [&](int min, int max, auto&& is_empty) {
+    while (min < max) {
+      const auto mid = min + (max - min) / 2;
+      if (is_empty(mid))
+        min = mid + 1;
+      else
+        max = mid;
+    }
+    return min;
+  };
+  const auto [x, y, w, h] = rect;
+  const auto top = search(1, h, [&](int n) { return is_empty({ x, y, w, n }); });
+  const auto bottom = search(1, h, [&](int n) { return is_empty({ x, y + h - n, w, n }); });
+  const auto used_y = y + top - 1;
+  const auto used_h = h - (top - 1) - (bottom - 1);
+  const auto left = search(1, w, [&](int n) { return is_empty({ x, used_y, n, used_h }); });
+  const auto right = search(1, w, [&](int n) { return is_empty({ x + w - n, used_y, n, used_h }); });
+  return { x + left - 1, used_y, w - (left - 1) - (right - 1), used_h };
+}
+
 Image Image::clone(const Rect& rect) const {
   if (empty(rect))
     return clone(bounds());
@@ -481,7 +1746,8 @@ Image Image::clone(const Rect& rect) const {
   return clone;
 }
 
-void save_image(const Image& image, const std::filesystem::path& path) {
+void save_image(const Image& image, const std::filesystem::path& path,
+    int max_colors, Dither dither) {
   if (!path.parent_path().empty())
     std::filesystem::create_directories(path.parent_path());
   const auto filename = path_to_utf8(path);
@@ -490,10 +1756,10 @@ void save_image(const Image& image, const std::filesystem::path& path) {
   const auto h = image.height();
   const auto comp = sizeof(RGBA);
   const auto data = image.rgba();
-  const auto stride = image.width() * to_int(sizeof(RGBA));
 
   stbi_write_tga_with_rle = 1;
-  if (!(extension == ".png" && stbi_write_png(filename.c_str(), w, h, comp, data, stride)) &&
+  if (!(extension == ".png" && (try_write_png_indexed(path, image, max_colors, dither) ||
+                                write_png_rgba(path, image))) &&
       !(extension == ".bmp" && stbi_write_bmp(filename.c_str(), w, h, comp, data)) &&
       !(extension == ".tga" && stbi_write_tga(filename.c_str(), w, h, comp, data)))
     error("writing file '", filename, "' failed");
@@ -528,6 +1794,20 @@ void copy_rect(const Image& source, const Rect& source_rect, Image& dest, int dx
   }
 }
 
+// only copies pixels which are not fully transparent
+void copy_rect_visible(const Image& source, const Rect& source_rect, Image& dest, int dx, int dy) {
+  const auto [sx, sy, w, h] = source_rect;
+  check_rect(source, source_rect);
+  check_rect(dest, { dx, dy, w, h });
+  for (auto y = 0; y < h; ++y) {
+    const auto source_row = source.rgba() + ((sy + y) * source.width() + sx);
+    const auto dest_row = dest.rgba() + ((dy + y) * dest.width() + dx);
+    for (auto x = 0; x < w; ++x)
+      if (source_row[x].a)
+        dest_row[x] = source_row[x];
+  }
+}
+
 void copy_rect_rotated_cw(const Image& source, const Rect& source_rect, Image& dest, int dx, int dy) {
   const auto [sx, sy, w, h] = source_rect;
   check_rect(source, source_rect);
@@ -543,19 +1823,29 @@ void copy_rect_rotated_cw(const Image& source, const Rect& source_rect, Image& d
 void copy_rect(const Image& source, const Rect& source_rect, Image& dest, int dx, int dy,
     const std::vector<PointF>& mask_vertices) {
   const auto [sx, sy, w, h] = source_rect;
+  check_rect(source, source_rect);
+  check_rect(dest, { dx, dy, w, h });
+  auto crossings = std::vector<real>();
   for (auto y = 0; y < h; ++y)
-    for (auto x = 0; x < w; ++x)
-      if (point_in_polygon(x + 0.5, y + 0.5, mask_vertices))
-        checked_rgba_at(dest, { dx + x, dy + y }) = checked_rgba_at(source, { sx + x, sy + y });
+    for_each_polygon_span(mask_vertices, y, w, crossings, [&](int x0, int x1) {
+      std::memcpy(
+        dest.rgba() + ((dy + y) * dest.width() + dx + x0),
+        source.rgba() + ((sy + y) * source.width() + sx + x0),
+        to_unsigned(x1 - x0) * sizeof(RGBA));
+    });
 }
 
 void copy_rect_rotated_cw(const Image& source, const Rect& source_rect, Image& dest, int dx, int dy,
     const std::vector<PointF>& mask_vertices) {
   const auto [sx, sy, w, h] = source_rect;
+  check_rect(source, source_rect);
+  check_rect(dest, { dx, dy, h, w });
+  auto crossings = std::vector<real>();
   for (auto y = 0; y < h; ++y)
-    for (auto x = 0; x < w; ++x)
-      if (point_in_polygon(x + 0.5, y + 0.5, mask_vertices))
-        checked_rgba_at(dest, { dx + (h-1 - y), dy + x }) = checked_rgba_at(source, { sx + x, sy + y });
+    for_each_polygon_span(mask_vertices, y, w, crossings, [&](int x0, int x1) {
+      for (auto x = x0; x < x1; ++x)
+        dest.rgba_at({ dx + (h-1 - y), dy + x }) = source.rgba_at({ sx + x, sy + y });
+    });
 }
 
 void extrude_rect(Image& image, const Rect& rect, int count, WrapMode mode,
@@ -657,70 +1947,64 @@ void fill_rect(Image& image, const Rect& rect, const RGBA& color) {
       blend(image, x, y, color);
 }
 
-bool is_opaque(const Image& image, const Rect& rect) {
-  if (empty(rect))
-    return is_opaque(image, image.bounds());
-
-  return all_of(image, rect, [](const RGBA& rgba) { return (rgba.a == 255); });
+bool is_opaque(const ImageView& image) {
+  return all_of(image, [](const RGBA& rgba) { return (rgba.a == 255); });
 }
 
-bool is_fully_transparent(const Image& image, int threshold, const Rect& rect) {
-  if (empty(rect))
-    return is_fully_transparent(image, threshold, image.bounds());
-
-  return all_of(image, rect, [&](const RGBA& rgba) { return (rgba.a < threshold); });
+bool is_fully_transparent(const ImageView& image, int threshold) {
+  return all_of(image, [&](const RGBA& rgba) { return (rgba.a < threshold); });
 }
 
-bool is_fully_black(const Image& image, int threshold, const Rect& rect) {
-  if (empty(rect))
-    return is_fully_black(image, threshold, image.bounds());
-
-  return all_of(image, rect, [&](const RGBA& rgba) { return (rgba.gray() < threshold); });
+bool is_fully_black(const ImageView& image, int threshold) {
+  return all_of(image, [&](const RGBA& rgba) { return (rgba.gray() < threshold); });
 }
 
-bool is_identical(const Image& image_a, const Rect& rect_a, const Image& image_b, const Rect& rect_b) {
-  check_rect(image_a, rect_a);
-  check_rect(image_b, rect_b);
+bool is_identical(const ImageView& image_a, const ImageView& image_b) {
+  const auto& rect_a = image_a.bounds();
+  const auto& rect_b = image_b.bounds();
   if (rect_a.w != rect_b.w || rect_a.h != rect_b.h)
     return false;
 
   for (auto y = 0; y < rect_a.h; ++y)
     if (std::memcmp(
-        image_a.rgba() + (rect_a.y + y) * image_a.width() + rect_a.x,
-        image_b.rgba() + (rect_b.y + y) * image_b.width() + rect_b.x,
+        image_a.row(rect_a.y + y) + rect_a.x,
+        image_b.row(rect_b.y + y) + rect_b.x,
         to_unsigned(rect_a.w) * sizeof(RGBA)))
       return false;
 
   return true;
 }
 
-Rect get_used_bounds(const Image& image, bool gray_levels, int threshold, const Rect& rect) {
-  if (empty(rect))
-    return get_used_bounds(image, gray_levels, threshold, image.bounds());
-
+Rect get_used_bounds(const ImageView& image, bool gray_levels, int threshold) {
+  const auto& rect = image.bounds();
   const auto x1 = rect.x + rect.w - 1;
   const auto y1 = rect.y + rect.h - 1;
 
-  const auto check = (gray_levels ? is_fully_black : is_fully_transparent);
+  const auto check = [&](const Rect& rect) {
+    const auto view = ImageView(image.row(0), image.stride(), rect);
+    return (gray_levels ? 
+      is_fully_black(view, threshold) : 
+      is_fully_transparent(view, threshold));
+  };
 
   auto min_y = rect.y;
   for (; min_y < y1; ++min_y)
-    if (!check(image, threshold, { rect.x, min_y, rect.w, 1 }))
+    if (!check({ rect.x, min_y, rect.w, 1 }))
       break;
 
   auto max_y = y1;
   for (; max_y > min_y; --max_y)
-    if (!check(image, threshold, { rect.x, max_y, rect.w, 1 }))
+    if (!check({ rect.x, max_y, rect.w, 1 }))
       break;
 
   auto min_x = rect.x;
   for (; min_x < x1; ++min_x)
-    if (!check(image, threshold, { min_x, min_y, 1, max_y - min_y + 1 }))
+    if (!check({ min_x, min_y, 1, max_y - min_y + 1 }))
       break;
 
   auto max_x = x1;
   for (; max_x > min_x; --max_x)
-    if (!check(image, threshold, { max_x, min_y, 1, max_y - min_y + 1 }))
+    if (!check({ max_x, min_y, 1, max_y - min_y + 1 }))
       break;
 
   return { min_x, min_y, max_x - min_x + 1, max_y - min_y + 1 };
@@ -748,52 +2032,14 @@ void replace_color(Image& image, RGBA original, RGBA color) {
       original, color);
 }
 
-std::vector<Rect> find_islands(const Image& image, int merge_distance,
-    bool gray_levels, const Rect& rect) {
-  if (empty(rect))
-    return find_islands(image, merge_distance, gray_levels,
-      get_used_bounds(image, gray_levels));
-
-  using Value = MonoImage::Value;
-  auto levels = (gray_levels ?
-    get_gray_levels(image, rect) :
-    get_alpha_levels(image, rect));
-
-  auto islands = std::vector<Rect>();
-  for (auto y = 0; y < rect.h; ++y)
-    for (auto x = 0; x < rect.w; ++x)
-      if (levels.value_at({ x, y })) {
-        auto min_x = x;
-        auto min_y = y;
-        auto max_x = x;
-        auto max_y = y;
-        flood_fill<8>(x, y, rect.w, rect.h,
-          Value{ },
-          [&](int x, int y) -> Value& { return levels.value_at({ x, y }); },
-          [&](const Value& pixel) { return (pixel != 0); },
-          [&](int x, int y) {
-            min_x = std::min(x, min_x);
-            min_y = std::min(y, min_y);
-            max_x = std::max(x, max_x);
-            max_y = std::max(y, max_y);
-          });
-        islands.push_back({ rect.x + min_x, rect.y + min_y, max_x - min_x + 1, max_y - min_y + 1 });
-      }
-
-  merge_adjacent_rects(image, islands, merge_distance, gray_levels);
-
-  // fuzzy sort from top to bottom, left to right
-  const auto center_considerably_less = [](const Rect& a, const Rect& b) {
-    const auto row_tolerance = std::min(a.h, b.h) / 4;
-    const auto ca = a.center();
-    const auto cb = b.center();
-    if (ca.y < cb.y - row_tolerance) return true;
-    if (cb.y < ca.y - row_tolerance) return false;
-    return std::tie(ca.x, ca.y) < std::tie(cb.x, cb.y);
-  };
-  std::stable_sort(begin(islands), end(islands), center_considerably_less);
+std::vector<Rect> find_islands(const ImageView& image, int merge_distance,
+    bool gray_levels) {
+  return label_islands(image, UsedPixels(image, gray_levels, 1), merge_distance);
+}
 
-  return islands;
+std::vector<Rect> find_islands(const Image& image, int merge_distance,
+    bool gray_levels) {
+  return label_islands(image, image.used_pixels(gray_levels, 1), merge_distance);
 }
 
 void clear_alpha(Image& image, RGBA color) {
@@ -835,30 +2081,60 @@ void premultiply_alpha(Image& image) {
 }
 
 void bleed_alpha(Image& image) {
-  rjm_texbleed(reinterpret_cast<unsigned char*>(image.rgba()),
-    image.width(), image.height(), 3, sizeof(RGBA),
-    image.width() * to_int(sizeof(RGBA)));
+  const auto window = image.bounds();
+  auto rows = std::vector<int>(to_unsigned(window.w * window.h));
+  const auto band_count = [](int size) {
+    return size_t{ to_unsigned(div_ceil(size, bleed_band_size)) };
+  };
+
+  scheduler.for_each_parallel([&](size_t index) {
+    const auto x0 = to_int(index) * bleed_band_size;
+    const auto x1 = std::min(x0 + bleed_band_size, window.w);
+    find_nearest_in_columns(image, window, x0, x1, 0, rows.data());
+  }, band_count(window.w));
+
+  scheduler.for_each_parallel([&](size_t index) {
+    const auto y0 = to_int(index) * bleed_band_size;
+    const auto y1 = std::min(y0 + bleed_band_size, window.h);
+    bleed_rows(image, window, y0, y1, 0, rows.data());
+  }, band_count(window.h));
 }
 
-MonoImage get_alpha_levels(const Image& image, const Rect& rect) {
-  if (empty(rect))
-    return get_alpha_levels(image, get_used_bounds(image, false));
-  check_rect(image, rect);
+void bleed_alpha(Image& image, const std::vector<Rect>& rects, int max_distance) {
+  if (max_distance <= 0)
+    return bleed_alpha(image);
 
-  auto result = MonoImage(rect.w, rect.h);
-  auto dest = result.data();
-  for_each_pixel(image, rect, [&](const RGBA& color) { *dest++ = color.a; });
-  return result;
-}
+  auto regions = std::vector<Rect>();
+  for (const auto& rect : rects)
+    if (auto region = intersect(expand(rect, max_distance), image.bounds()); !empty(region))
+      regions.push_back(region);
 
-MonoImage get_gray_levels(const Image& image, const Rect& rect) {
-  if (empty(rect))
-    return get_gray_levels(image, get_used_bounds(image, true));
-  check_rect(image, rect);
+  // each band only writes its own rows, but reads the rows within reach
+  const auto h = image.height();
+  scheduler.for_each_parallel([&](size_t index) {
+    const auto y0 = to_int(index) * bleed_band_size;
+    const auto y1 = std::min(y0 + bleed_band_size, h);
+    const auto wy0 = std::max(y0 - max_distance, 0);
+    const auto wy1 = std::min(y1 + max_distance, h);
+    auto rows = std::vector<int>();
+    for (const auto& [x0, x1] : get_row_intervals(regions, y0, y1)) {
+      const auto window = Rect{ x0, wy0, x1 - x0, wy1 - wy0 };
+      rows.resize(to_unsigned(window.w * window.h));
+      find_nearest_in_columns(image, window, x0, x1, max_distance, rows.data());
+      bleed_rows(image, window, y0, y1, max_distance, rows.data());
+    }
+  }, size_t{ to_unsigned(div_ceil(h, bleed_band_size)) });
+}
 
-  auto result = MonoImage(rect.w, rect.h);
+MonoImage get_levels(const ChannelView& levels) {
+  auto result = MonoImage(levels.width(), levels.height());
   auto dest = result.data();
-  for_each_pixel(image, rect, [&](const RGBA& color) { *dest++ = color.gray(); });
+  const auto& rect = levels.bounds();
+  for (auto y = rect.y; y < rect.y1(); ++y) {
+    const auto row = levels.row(y);
+    for (auto x = rect.x; x < rect.x1(); ++x)
+      *dest++ = levels.value(row[x]);
+  }
   return result;
 }
 
@@ -886,45 +2162,36 @@ Image resize_image(const Image& image, real scale, ResizeFilter filter) {
   return output;
 }
 
-Palette generate_palette(const Image& image_, int count) {
-  auto image = image_.clone();
-  const auto size = static_cast<size_t>(image.width() * image.height());
-  return median_cut_reduction({ image.rgba(), size }, count);
+Palette generate_palette(const ImageView& image, int count) {
+  auto histogram = ColorHistogram();
+  histogram.add(image);
+  return generate_palette(histogram, count);
 }
 
 Palette generate_palette(const Animation& animation, int count) {
-  auto merged_size = size_t{ };
-  for (const auto& frame : animation.frames)
-    merged_size += static_cast<size_t>(frame.image.width() * frame.image.height());
-  auto merged = std::make_unique<RGBA[]>(merged_size);
-  auto pos = merged.get();
-  for (const auto& frame : animation.frames) {
-    const auto size = static_cast<size_t>(frame.image.width() * frame.image.height());
-    std::memcpy(pos, frame.image.rgba(), size * sizeof(RGBA));
-    pos += size;
-  }
-  return median_cut_reduction({ merged.get(), merged_size }, count);
-}
-
-MonoImage quantize_image(const Image& image, const Palette& palette, bool dither) {
-  if (dither)
-    return quantize_image(floyd_steinberg_dithering(
-      image.clone(), palette), palette, false);
-
-  auto out = MonoImage(image.width(), image.height());
-  for (auto y = 0; y < image.height(); ++y)
-    for (auto x = 0; x < image.width(); ++x)
-      out.value_at({ x, y }) = to_byte(
-        index_of_closest_palette_color(palette, image.rgba_at({ x, y })));
-  return out;
+  // frames are composed in parallel, but all are added to a
+  // single histogram, which reuses its band histograms
+  auto histogram = ColorHistogram();
+  for_each_frame(animation,
+    [](Image image) { return image; },
+    [&](const Animation::Frame&, Image image) { histogram.add(image); });
+  return generate_palette(histogram, count);
+}
+
+MonoImage quantize_image(const ImageView& image, const Palette& palette, Dither dither) {
+  return quantize_image(image, PaletteLookup(palette), dither);
 }
 
-Image apply_palette(const MonoImage& image, const Palette& palette) {
+Image apply_palette(const MonoImageView& image, const Palette& palette) {
   auto out = Image(image.width(), image.height());
   const auto max = to_byte(palette.size() - 1);
-  for (auto y = 0; y < image.height(); ++y)
-    for (auto x = 0; x < image.width(); ++x)
-      out.rgba_at({ x, y }) = palette[std::min(max, image.value_at({ x, y }))];
+  const auto& rect = image.bounds();
+  auto dest = out.rgba();
+  for (auto y = rect.y; y < rect.y1(); ++y) {
+    const auto row = image.row(y);
+    for (auto x = rect.x; x < rect.x1(); ++x)
+      *dest++ = palette[std::min(max, row[x])];
+  }
   return out;
 }
 
@@ -2,9 +2,14 @@
 
 #include "common.h"
 #include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
 
 namespace spright {
 
+class UsedPixels;
+
 class Image {
 public:
   Image() = default;
@@ -23,16 +28,27 @@ public:
   int height() const { return m_height; }
   Rect bounds() const { return { 0, 0, m_width, m_height }; }
   const RGBA* rgba() const { return m_data; }
-  RGBA* rgba() { return m_data; }
-  RGBA& rgba_at(const Point& p) { return m_data[p.y * m_width + p.x]; }
+  RGBA* rgba() { invalidate_used_pixels(); return m_data; }
+  RGBA& rgba_at(const Point& p) { invalidate_used_pixels(); return m_data[p.y * m_width + p.x]; }
   const RGBA& rgba_at(const Point& p) const { return m_data[p.y * m_width + p.x]; }
 
+  // computed on first use, discarded when the pixels are accessed mutably
+  const UsedPixels& used_pixels(bool gray_levels, int threshold) const;
+
 private:
+  void invalidate_used_pixels() {
+    if (!m_used_pixels.empty())
+      clear_used_pixels();
+  }
+  void clear_used_pixels();
+
   std::filesystem::path m_path;
   std::filesystem::path m_filename;
   RGBA* m_data{ };
   int m_width{ };
   int m_height{ };
+  mutable std::mutex m_used_pixels_mutex;
+  mutable std::vector<std::unique_ptr<const UsedPixels>> m_used_pixels;
 };
 
 class MonoImage {
@@ -61,6 +77,103 @@ private:
   int m_height{ };
 };
 
+// non-owning views on a rect of an image, coordinates are the image's
+class ImageView {
+public:
+  ImageView() = default;
+  ImageView(const Image& image)
+    : ImageView(image.rgba(), image.width(), image.bounds()) { }
+  ImageView(const Image& image, const Rect& rect);
+  ImageView(const RGBA* data, int stride, const Rect& bounds)
+    : m_data(data), m_stride(stride), m_bounds(bounds) { }
+  ImageView view(const Rect& rect) const;
+  explicit operator bool() const { return m_data != nullptr; }
+
+  int width() const { return m_bounds.w; }
+  int height() const { return m_bounds.h; }
+  int stride() const { return m_stride; }
+  const Rect& bounds() const { return m_bounds; }
+  const RGBA* row(int y) const { return m_data + y * m_stride; }
+  const RGBA& rgba_at(const Point& p) const { return m_data[p.y * m_stride + p.x]; }
+
+private:
+  const RGBA* m_data{ };
+  int m_stride{ };
+  Rect m_bounds{ };
+};
+
+class MonoImageView {
+public:
+  using Value = MonoImage::Value;
+
+  MonoImageView() = default;
+  MonoImageView(const MonoImage& image)
+    : MonoImageView(image.data(), image.width(), image.bounds()) { }
+  MonoImageView(const MonoImage& image, const Rect& rect);
+  MonoImageView(const Value* data, int stride, const Rect& bounds)
+    : m_data(data), m_stride(stride), m_bounds(bounds) { }
+  MonoImageView view(const Rect& rect) const;
+  explicit operator bool() const { return m_data != nullptr; }
+
+  int width() const { return m_bounds.w; }
+  int height() const { return m_bounds.h; }
+  int stride() const { return m_stride; }
+  const Rect& bounds() const { return m_bounds; }
+  const Value* row(int y) const { return m_data + y * m_stride; }
+  const Value& value_at(const Point& p) const { return m_data[p.y * m_stride + p.x]; }
+
+private:
+  const Value* m_data{ };
+  int m_stride{ };
+  Rect m_bounds{ };
+};
+
+// evaluates the alpha or gray levels of an image view on access
+class ChannelView {
+public:
+  using Value = MonoImage::Value;
+
+  ChannelView(const ImageView& view, bool gray_levels)
+    : m_view(view), m_gray_levels(gray_levels) { }
+  ChannelView view(const Rect& rect) const { return { m_view.view(rect), m_gray_levels }; }
+
+  int width() const { return m_view.width(); }
+  int height() const { return m_view.height(); }
+  const Rect& bounds() const { return m_view.bounds(); }
+  bool gray_levels() const { return m_gray_levels; }
+  Value value_at(const Point& p) const { return value(m_view.rgba_at(p)); }
+  Value value(const RGBA& rgba) const { return (m_gray_levels ? rgba.gray() : rgba.a); }
+  const RGBA* row(int y) const { return m_view.row(y); }
+
+private:
+  ImageView m_view;
+  bool m_gray_levels{ };
+};
+
+// summed-area table of the pixels, which are at or above a threshold,
+// for answering emptiness and bounds queries without rescanning the image
+class UsedPixels {
+public:
+  UsedPixels(const ImageView& image, bool gray_levels, int threshold);
+
+  bool gray_levels() const { return m_gray_levels; }
+  int threshold() const { return m_threshold; }
+  const Rect& bounds() const { return m_bounds; }
+  int count(const Rect& rect) const;
+  bool is_empty(const Rect& rect) const { return (count(rect) == 0); }
+  Rect get_used_bounds(const Rect& rect) const;
+
+private:
+  uint32_t sum(int x, int y) const {
+    return m_sums[to_unsigned((y - m_bounds.y) * (m_bounds.w + 1) + (x - m_bounds.x))];
+  }
+
+  bool m_gray_levels{ };
+  int m_threshold{ };
+  Rect m_bounds{ };
+  std::vector<uint32_t> m_sums;
+};
+
 enum class WrapMode { 
   clamp, mirror, repeat 
 };
@@ -74,21 +187,31 @@ enum class ResizeFilter {
   mitchell      // Mitchell-Netrevalli filter with B=1/3, C=1/3
 };
 
+enum class Dither {
+  floyd_steinberg,
+  ordered,
+  none
+};
+
 struct Animation {
   struct Frame {
     int index;
-    Image image;
     real duration;
   };
   std::vector<Frame> frames;
+  // composes a frame's image, it is called once for each pass over the
+  // frames, so only a few of them need to be kept in memory at once
+  std::function<Image(const Frame&)> get_frame_image;
   int max_colors{ };
+  Dither dither{ };
   std::optional<RGBA> color_key;
   int loop_count;
 };
 
 using Palette = std::vector<RGBA>;
 
-void save_image(const Image& image, const std::filesystem::path& filename);
+void save_image(const Image& image, const std::filesystem::path& filename,
+  int max_colors = 0, Dither dither = { });
 void save_animation(const Animation& animation, const std::filesystem::path& filename);
 Image resize_image(const Image& image, real scale, ResizeFilter filter);
 void copy_rect(const Image& source, const Rect& source_rect, Image& dest, int dx, int dy);
@@ -97,6 +220,7 @@ void copy_rect(const Image& source, const Rect& source_rect, Image& dest,
   int dx, int dy, const std::vector<PointF>& mask_vertices);
 void copy_rect_rotated_cw(const Image& source, const Rect& source_rect, Image& dest, 
   int dx, int dy, const std::vector<PointF>& mask_vertices);
+void copy_rect_visible(const Image& source, const Rect& source_rect, Image& dest, int dx, int dy);
 void extrude_rect(Image& image, const Rect& rect, int count, WrapMode mode, 
   bool left, bool top, bool right, bool bottom);
 void draw_rect(Image& image, const Rect& rect, const RGBA& color);
@@ -106,25 +230,27 @@ void draw_line_stipple(Image& image, const Point& p0, const Point& p1,
   const RGBA& color, int stipple, bool omit_last = false);
 void draw_rect_stipple(Image& image, const Rect& rect, const RGBA& color, int stipple);
 void fill_rect(Image& image, const Rect& rect, const RGBA& color);
-bool is_opaque(const Image& image, const Rect& rect = { });
-bool is_fully_transparent(const Image& image, int threshold = 1, const Rect& rect = { });
-bool is_fully_black(const Image& image, int threshold = 1, const Rect& rect = { });
-bool is_identical(const Image& image_a, const Rect& rect_a, const Image& image_b, const Rect& rect_b);
-Rect get_used_bounds(const Image& image, bool gray_levels, int threshold = 1, const Rect& rect = { });
+bool is_opaque(const ImageView& image);
+bool is_fully_transparent(const ImageView& image, int threshold = 1);
+bool is_fully_black(const ImageView& image, int threshold = 1);
+bool is_identical(const ImageView& image_a, const ImageView& image_b);
+Rect get_used_bounds(const ImageView& image, bool gray_levels, int threshold = 1);
 RGBA guess_colorkey(const Image& image);
 void replace_color(Image& image, RGBA original, RGBA color);
-std::vector<Rect> find_islands(const Image& image, int merge_distance, 
-  bool gray_levels, const Rect& rect = { });
+std::vector<Rect> find_islands(const ImageView& image, int merge_distance, 
+  bool gray_levels);
+std::vector<Rect> find_islands(const Image& image, int merge_distance,
+  bool gray_levels);
 void clear_alpha(Image& image, RGBA color);
 void make_opaque(Image& image);
 void make_opaque(Image& image, RGBA background);
 void premultiply_alpha(Image& image);
 void bleed_alpha(Image& image);
-MonoImage get_alpha_levels(const Image& image, const Rect& rect = { });
-MonoImage get_gray_levels(const Image& image, const Rect& rect = { });
-Palette generate_palette(const Image& image, int count);
+void bleed_alpha(Image& image, const std::vector<Rect>& rects, int max_distance);
+MonoImage get_levels(const ChannelView& levels);
+Palette generate_palette(const ImageView& image, int count);
 Palette generate_palette(const Animation& animation, int count);
-MonoImage quantize_image(const Image& image, const Palette& palette, bool dither);
-Image apply_palette(const MonoImage& image, const Palette& palette);
+MonoImage quantize_image(const ImageView& image, const Palette& palette, Dither dither);
+Image apply_palette(const MonoImageView& image, const Palette& palette);
 
 } // namespace
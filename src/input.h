@@ -24,11 +24,11 @@ struct AnchorT : PointT<T> {
 using Anchor = AnchorT<int>;
 using AnchorF = AnchorT<real>;
 
-enum class Trim { none, rect, convex };
+enum class Trim { none, rect, convex, polygon };
 
 enum class Alpha { keep, opaque, clear, bleed, premultiply, colorkey };
 
-enum class Pack { binpack, rows, columns, compact, origin, single, layers, keep };
+enum class Pack { binpack, rows, columns, compact, origin, single, layers, keep, skyline, pixels, hierarchical };
 
 enum class Duplicates { keep, share, drop };
 
@@ -50,9 +50,12 @@ struct Output {
   std::vector<std::string> map_suffixes;
   Alpha alpha{ };
   RGBA alpha_color{ };
+  int bleed_distance{ };
   real scale{ };
   ResizeFilter scale_filter{ };
   bool debug{ };
+  Dither dither{ };
+  int max_colors{ };
 };
 
 struct Sheet {
@@ -72,6 +75,9 @@ struct Sheet {
   int shape_padding{ };
   Duplicates duplicates{ };
   Pack pack{ };
+  real pack_time{ };
+  std::filesystem::path pack_incremental;
+  real max_fragmentation{ };
 };
 
 struct Sprite {
@@ -92,6 +98,8 @@ struct Sprite {
   int trim_margin{ };
   int trim_threshold{ };
   bool trim_gray_levels{ };
+  int trim_vertices{ };
+  real trim_tolerance{ };
   bool crop{ };
   bool crop_pivot{ };
   Extrude extrude{ };
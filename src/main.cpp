@@ -63,6 +63,10 @@ int main(int argc, const char* argv[]) try {
         std::chrono::duration_cast<std::chrono::milliseconds>(
           time_points[i].first - time_points[i - 1].first).count() << "ms";
     std::cout << std::endl;
+
+    for (const auto& slice : slices)
+      std::cout << "slice " << slice.index << ": " << slice.width << "x" << 
+        slice.height << ", " << to_int(get_slice_efficiency(slice) * 100) << "% used" << std::endl;
   }
   return (has_warnings() ? 2 : 0);
 }
@@ -30,7 +30,12 @@ namespace {
     if (!source)
       return false;
 
-    if (sprite.rotated) {
+    if (sprite.sheet->pack == Pack::pixels) {
+      // sprites' rects may overlap
+      copy_rect_visible(*source, sprite.trimmed_source_rect,
+        target, sprite.trimmed_rect.x, sprite.trimmed_rect.y);
+    }
+    else if (sprite.rotated) {
       if (has_rect_vertices(sprite)) {
         copy_rect_rotated_cw(*source, sprite.trimmed_source_rect,
           target, sprite.trimmed_rect.x, sprite.trimmed_rect.y);
@@ -77,7 +82,18 @@ namespace {
 #endif
   }
 
-  void process_alpha(Image& target, const Output& output) {
+  std::vector<Rect> get_sprite_rects(SpriteSpan sprites) {
+    auto rects = std::vector<Rect>();
+    for (const auto& sprite : sprites) {
+      auto rect = sprite.trimmed_rect;
+      if (sprite.rotated)
+        std::swap(rect.w, rect.h);
+      rects.push_back(expand(rect, sprite.extrude.count));
+    }
+    return rects;
+  }
+
+  void process_alpha(Image& target, const Output& output, SpriteSpan sprites) {
     switch (output.alpha) {
       case Alpha::keep:
         break;
@@ -91,7 +107,10 @@ namespace {
         break;
 
       case Alpha::bleed:
-        bleed_alpha(target);
+        if (output.bleed_distance > 0)
+          bleed_alpha(target, get_sprite_rects(sprites), output.bleed_distance);
+        else
+          bleed_alpha(target);
         break;
 
       case Alpha::premultiply:
@@ -115,9 +134,10 @@ namespace {
         texture.slice->last_source_written_time);
   }
 
-  void process_texture_image(const Texture& texture, Image& image) {
+  void process_texture_image(const Texture& texture, Image& image,
+      SpriteSpan sprites) {
     const auto& output = *texture.output;
-    process_alpha(image, output);
+    process_alpha(image, output, sprites);
 
     if (output.scale != 1.0)
       image = resize_image(image, output.scale, output.scale_filter);
@@ -135,12 +155,13 @@ namespace {
     if (is_map(texture) && is_up_to_date(texture))
       return true;
     
-    process_texture_image(texture, image);
+    process_texture_image(texture, image, texture.slice->sprites);
 
     if (texture.output->debug)
       draw_debug_info(image, *texture.slice, texture.output->scale);
 
-    save_image(image, texture.filename);
+    save_image(image, texture.filename,
+      texture.output->max_colors, texture.output->dither);
     return true;
   }
 
@@ -157,17 +178,23 @@ namespace {
     if (is_map(texture) && is_up_to_date(texture))
       return true;
     
-    scheduler.for_each_parallel(animation.frames, 
-      [&](Animation::Frame& frame) {
-        process_texture_image(texture, frame.image);
-
-        if (texture.output->debug)
-          draw_debug_info(frame.image, 
-            texture.slice->sprites[to_unsigned(frame.index)], texture.output->scale);
-      });
+    animation.get_frame_image = [&texture,
+        compose = std::move(animation.get_frame_image)](
+        const Animation::Frame& frame) {
+      auto image = compose(frame);
+      process_texture_image(texture, image,
+        texture.slice->sprites.subspan(to_unsigned(frame.index), 1));
+
+      if (texture.output->debug)
+        draw_debug_info(image, 
+          texture.slice->sprites[to_unsigned(frame.index)], texture.output->scale);
+      return image;
+    };
 
     if (texture.output->alpha == Alpha::colorkey)
       animation.color_key = texture.output->alpha_color;
+    animation.dither = texture.output->dither;
+    animation.max_colors = texture.output->max_colors;
     save_animation(animation, texture.filename);
     return true;
   }
@@ -191,16 +218,18 @@ Image get_slice_image(const Slice& slice, int map_index) {
   return target;
 }
 
+// frames are indexed by the sprite's index within the slice
 Animation get_slice_animation(const Slice& slice, int map_index) {
   auto animation = Animation();
-  for (const auto& sprite : slice.sprites)
-    if (const auto source = get_source(sprite, map_index)) {
-      auto& frame = animation.frames.emplace_back();
-      frame.index = static_cast<int>(animation.frames.size() - 1);
-      frame.image = Image(slice.width, slice.height, RGBA());
-      copy_sprite(frame.image, sprite, map_index);
-      frame.duration = 0.1;
-    }
+  for (auto i = size_t{ }; i < slice.sprites.size(); ++i)
+    if (get_source(slice.sprites[i], map_index))
+      animation.frames.push_back({ to_int(i), 0.1 });
+
+  animation.get_frame_image = [&slice, map_index](const Animation::Frame& frame) {
+    auto image = Image(slice.width, slice.height, RGBA());
+    copy_sprite(image, slice.sprites[to_unsigned(frame.index)], map_index);
+    return image;
+  };
   return animation;
 }
 
@@ -1,54 +1,410 @@
 
 #include "packing.h"
 #include "rect_pack/rect_pack.h"
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <random>
 
 namespace spright {
 
+namespace {
+  using PackSheets = std::vector<rect_pack::Sheet>;
+
+  size_t count_rects(const PackSheets& sheets) {
+    auto count = size_t{ };
+    for (const auto& sheet : sheets)
+      count += sheet.rects.size();
+    return count;
+  }
+
+  int64_t get_area(const PackSheets& sheets) {
+    auto area = int64_t{ };
+    for (const auto& sheet : sheets)
+      area += int64_t{ sheet.width } * sheet.height;
+    return area;
+  }
+
+  // more rects packed, then fewer sheets, then less area
+  bool is_better(const PackSheets& a, const PackSheets& b) {
+    const auto count_a = count_rects(a);
+    const auto count_b = count_rects(b);
+    if (count_a != count_b)
+      return (count_a > count_b);
+    if (a.size() != b.size())
+      return (a.size() < b.size());
+    return (get_area(a) < get_area(b));
+  }
+
+  // when all rects fit on a single sheet without any space left,
+  // no other method can do better
+  bool is_optimal(const PackSheets& sheets, size_t rect_count,
+      int64_t rects_area, int border_padding) {
+    if (sheets.size() != 1 || sheets[0].rects.size() != rect_count)
+      return false;
+    const auto& sheet = sheets[0];
+    return (int64_t{ sheet.width - 2 * border_padding } *
+      (sheet.height - 2 * border_padding) <= rects_area);
+  }
+
+  struct PackInput {
+    rect_pack::Settings settings;
+    std::vector<rect_pack::Size> sizes;
+    int64_t rects_area;
+  };
+
+  // MaxRects methods choose the best placement of all remaining rects
+  // for each rect they place, which takes about cubic time, so they are
+  // only raced up to a fixed number of rects, which keeps the layout
+  // independent of the machine's speed
+  const auto max_rects_max_count = size_t{ 2000 };
+
+  bool is_max_rects_affordable(const PackInput& input) {
+    return (input.sizes.size() <= max_rects_max_count);
+  }
+
+  // the concrete methods, which rect_pack's Best methods try in sequence
+  std::vector<rect_pack::Method> get_candidate_methods(
+      const PackInput& input, bool fast) {
+    using Method = rect_pack::Method;
+    auto methods = std::vector<Method>{
+      Method::Skyline_BestFit,
+      Method::Skyline_BottomLeft,
+    };
+    if (!fast && is_max_rects_affordable(input))
+      methods.insert(methods.end(), {
+        Method::MaxRects_BestShortSideFit,
+        Method::MaxRects_BestLongSideFit,
+        Method::MaxRects_BestAreaFit,
+        Method::MaxRects_BottomLeftRule,
+        Method::MaxRects_ContactPointRule,
+      });
+    return methods;
+  }
+
+  int get_min_width(const PackInput& input) {
+    const auto& settings = input.settings;
+    auto min_width = settings.min_width;
+    for (const auto& size : input.sizes)
+      min_width = std::max(min_width, (settings.allow_rotate ?
+        std::min(size.width, size.height) : size.width) + 2 * settings.border_padding);
+    return min_width;
+  }
+
+  // besides the maximum width, narrower sheets around the square
+  // of the rects' area are tried, unless the width is fixed
+  std::vector<int> get_candidate_widths(const PackInput& input) {
+    const auto& settings = input.settings;
+    auto widths = std::vector<int>{ settings.max_width };
+    if (settings.min_width > 0 && settings.min_width == settings.max_width)
+      return widths;
+    const auto min_width = get_min_width(input);
+    const auto square = std::sqrt(to_real(input.rects_area)) +
+      2 * settings.border_padding;
+    for (auto factor : { 1.0, 1.5 }) {
+      const auto width = std::max(min_width, to_int(std::ceil(square * factor)));
+      if (width < settings.max_width &&
+          std::find(widths.begin(), widths.end(), width) == widths.end())
+        widths.push_back(width);
+    }
+    return widths;
+  }
+
+  // the best raced result and the candidate which produced it
+  struct RaceResult {
+    PackSheets sheets;
+    rect_pack::Method method;
+    int max_width;
+  };
+
+  // race the methods with each candidate width. rect_pack cannot be
+  // interrupted and a result can only be proven to be unbeatable when it
+  // is optimal, which is rare, so usually all candidates run to completion.
+  // candidates which follow an optimal one and did not start yet are skipped
+  RaceResult pack_racing(const PackInput& input,
+      const std::vector<rect_pack::Method>& methods) {
+    const auto widths = get_candidate_widths(input);
+    auto results = std::vector<PackSheets>(methods.size() * widths.size());
+    auto first_optimal = std::atomic<size_t>{ results.size() };
+    scheduler.for_each_parallel([&](size_t index) {
+      if (first_optimal.load() < index)
+        return;
+      auto settings = input.settings;
+      settings.method = methods[index % methods.size()];
+      settings.max_width = widths[index / methods.size()];
+      results[index] = rect_pack::pack(settings, input.sizes);
+      // optimal results tie, unless the border padding makes their areas
+      // differ, an earlier candidate wins a tie, so later ones can be skipped
+      if (!settings.border_padding && is_optimal(results[index],
+            input.sizes.size(), input.rects_area, settings.border_padding)) {
+        auto current = first_optimal.load();
+        while (index < current &&
+               !first_optimal.compare_exchange_weak(current, index)) { }
+      }
+    }, results.size());
+
+    // first best result in order of candidates, for deterministic output
+    auto best = size_t{ };
+    for (auto index = size_t{ 1 }; index < results.size(); ++index)
+      if (is_better(results[index], results[best]))
+        best = index;
+    return {
+      std::move(results[best]),
+      methods[best % methods.size()],
+      widths[best / methods.size()],
+    };
+  }
+
+  // a variation of the input, which is passed to rect_pack
+  struct Variation {
+    rect_pack::Method method;
+    int max_width;
+    std::vector<bool> flipped;
+  };
+
+  PackSheets pack_variation(const PackInput& input, const Variation& variation) {
+    auto settings = input.settings;
+    settings.method = variation.method;
+    settings.max_width = variation.max_width;
+    auto sizes = input.sizes;
+    for (auto& size : sizes)
+      if (variation.flipped[to_unsigned(size.id)])
+        std::swap(size.width, size.height);
+
+    auto sheets = rect_pack::pack(settings, std::move(sizes));
+    for (auto& sheet : sheets)
+      for (auto& rect : sheet.rects)
+        if (variation.flipped[to_unsigned(rect.id)])
+          rect.rotated = !rect.rotated;
+    return sheets;
+  }
+
+  // starts with the raced result and keeps improving it with randomized
+  // restarts and local search, until the time budget is exhausted
+  PackSheets pack_anytime(const PackInput& input,
+      const std::vector<rect_pack::Method>& methods, real pack_time) {
+    using Clock = std::chrono::steady_clock;
+    const auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<real>(pack_time));
+
+    const auto& settings = input.settings;
+    const auto min_width = get_min_width(input);
+    const auto max_width = std::max(min_width, std::min(settings.max_width,
+      min_width + to_int(2 * std::sqrt(to_real(input.rects_area)))));
+
+    auto mutex = std::mutex();
+    // the local search starts from the variation which won the race
+    auto raced = pack_racing(input, methods);
+    auto best = std::move(raced.sheets);
+    auto best_variation = Variation{ raced.method, raced.max_width,
+      std::vector<bool>(input.sizes.size()) };
+    auto found_optimal = is_optimal(best, input.sizes.size(),
+      input.rects_area, settings.border_padding);
+
+    const auto worker_count = std::max(std::thread::hardware_concurrency(), 1u);
+    scheduler.for_each_parallel([&](size_t index) {
+      auto random = std::mt19937(static_cast<std::mt19937::result_type>(index));
+      const auto random_int = [&](int min, int max) {
+        return std::uniform_int_distribution<int>(min, max)(random);
+      };
+      const auto random_method = [&]() {
+        return methods[to_unsigned(random_int(0, to_int(methods.size()) - 1))];
+      };
+
+      for (auto restart = true; ; restart = !restart) {
+        auto lock = std::unique_lock(mutex);
+        if (found_optimal || Clock::now() >= deadline)
+          break;
+        auto variation = best_variation;
+        lock.unlock();
+
+        if (restart) {
+          variation.method = random_method();
+          variation.max_width = random_int(min_width, max_width);
+          if (settings.allow_rotate)
+            for (auto i = 0u; i < variation.flipped.size(); ++i)
+              variation.flipped[i] = (random_int(0, 1) == 1);
+        }
+        else {
+          // modify one aspect of best variation
+          switch (random_int(0, 2)) {
+            case 0:
+              variation.method = random_method();
+              break;
+            case 1: {
+              const auto delta = std::max(variation.max_width / 20, 1);
+              variation.max_width = std::clamp(variation.max_width +
+                random_int(-delta, delta), min_width, max_width);
+              break;
+            }
+            case 2:
+              if (settings.allow_rotate) {
+                const auto count = std::max(to_int(variation.flipped.size()) / 20, 1);
+                for (auto i = 0; i < count; ++i)
+                  variation.flipped[to_unsigned(random_int(0,
+                    to_int(variation.flipped.size()) - 1))].flip();
+              }
+              break;
+          }
+        }
+
+        auto sheets = pack_variation(input, variation);
+        lock.lock();
+        if (is_better(sheets, best)) {
+          best = std::move(sheets);
+          best_variation = std::move(variation);
+          found_optimal = is_optimal(best, input.sizes.size(),
+            input.rects_area, settings.border_padding);
+        }
+      }
+    }, size_t{ worker_count });
+    return best;
+  }
+
+  // a grid of rects of the same size, single rects have one column
+  struct Block {
+    int columns;
+    int cell_width;
+    int cell_height;
+    std::vector<int> ids;
+  };
+
+  const auto min_size_class_count = size_t{ 32 };
+  const auto max_size_classes = 4;
+
+  // chooses the columns with the least empty cells, then the most square
+  int get_grid_columns(int count, int cell_width, int cell_height,
+      int max_columns, int max_rows) {
+    const auto estimate = static_cast<int>(std::ceil(std::sqrt(
+      to_real(count) * cell_height / cell_width)));
+    auto best = std::pair(std::numeric_limits<int>::max(), int64_t{ });
+    auto best_columns = max_columns;
+    const auto last = std::min(max_columns, estimate * 2);
+    for (auto columns = std::max(estimate / 2, 1); columns <= last; ++columns) {
+      const auto rows = (count + columns - 1) / columns;
+      if (rows > max_rows)
+        continue;
+      const auto aspect = std::abs(int64_t{ columns } * cell_width -
+        int64_t{ rows } * cell_height);
+      const auto current = std::pair(columns * rows - count, aspect);
+      if (current < best) {
+        best = current;
+        best_columns = columns;
+      }
+    }
+    return best_columns;
+  }
+
+  // when most sizes fall into a few size classes, these are arranged
+  // in grids, which are packed as a whole together with the leftovers
+  std::vector<Block> get_size_class_blocks(const rect_pack::Settings& settings,
+      const std::vector<rect_pack::Size>& sizes) {
+    auto classes = std::map<std::pair<int, int>, std::vector<int>>();
+    for (const auto& size : sizes)
+      classes[{ size.width, size.height }].push_back(size.id);
+
+    auto in_classes = size_t{ };
+    auto class_count = 0;
+    for (const auto& [size, ids] : classes)
+      if (ids.size() >= min_size_class_count) {
+        in_classes += ids.size();
+        ++class_count;
+      }
+    if (class_count > max_size_classes || in_classes * 4 < sizes.size() * 3)
+      return { };
+
+    const auto get_available = [&](int max_size) {
+      return (max_size > 0 ? max_size - 2 * settings.border_padding +
+        settings.over_allocate : std::numeric_limits<int>::max());
+    };
+    const auto available_width = get_available(settings.max_width);
+    const auto available_height = get_available(settings.max_height);
+
+    auto blocks = std::vector<Block>();
+    for (const auto& [size, ids] : classes) {
+      const auto [width, height] = size;
+      const auto max_columns = available_width / width;
+      const auto max_rows = available_height / height;
+      if (ids.size() < min_size_class_count || !max_columns || !max_rows) {
+        for (auto id : ids)
+          blocks.push_back({ 1, width, height, { id } });
+        continue;
+      }
+      const auto per_block = to_unsigned(std::min(int64_t{ max_columns } *
+        max_rows, int64_t{ std::numeric_limits<int>::max() }));
+      for (auto begin = size_t{ }; begin < ids.size(); begin += per_block) {
+        const auto end = std::min(begin + per_block, ids.size());
+        const auto count = to_int(end - begin);
+        blocks.push_back({
+          get_grid_columns(count, width, height, max_columns, max_rows),
+          width, height,
+          { ids.begin() + static_cast<std::ptrdiff_t>(begin),
+            ids.begin() + static_cast<std::ptrdiff_t>(end) }
+        });
+      }
+    }
+    return blocks;
+  }
+
+  std::vector<rect_pack::Size> get_block_sizes(const std::vector<Block>& blocks) {
+    auto sizes = std::vector<rect_pack::Size>();
+    sizes.reserve(blocks.size());
+    for (const auto& block : blocks) {
+      const auto rows = (to_int(block.ids.size()) + block.columns - 1) / block.columns;
+      sizes.push_back({ to_int(sizes.size()),
+        block.columns * block.cell_width, rows * block.cell_height });
+    }
+    return sizes;
+  }
+
+  // places the rects of each block within the block's rect,
+  // a rotated block contains rotated rects with transposed rows/columns
+  void expand_blocks(const std::vector<Block>& blocks, PackSheets& sheets) {
+    for (auto& sheet : sheets) {
+      auto rects = std::vector<rect_pack::Rect>();
+      for (const auto& block_rect : sheet.rects) {
+        const auto& block = blocks[to_unsigned(block_rect.id)];
+        for (auto i = 0; i < to_int(block.ids.size()); ++i) {
+          const auto column = i % block.columns;
+          const auto row = i / block.columns;
+          auto rect = rect_pack::Rect{ block.ids[to_unsigned(i)],
+            block_rect.x + column * block.cell_width,
+            block_rect.y + row * block.cell_height,
+            block.cell_width, block.cell_height, block_rect.rotated };
+          if (rect.rotated) {
+            rect.x = block_rect.x + row * block.cell_height;
+            rect.y = block_rect.y + column * block.cell_width;
+            std::swap(rect.width, rect.height);
+          }
+          rects.push_back(rect);
+        }
+      }
+      sheet.rects = std::move(rects);
+    }
+  }
+} // namespace
+
 void pack_binpack(const SheetPtr& sheet_ptr, SpriteSpan sprites,
     std::vector<Slice>& slices, bool fast) {
   const auto& sheet = *sheet_ptr;
 
   // pack rects
-  auto pack_sizes = std::vector<rect_pack::Size>();
-  pack_sizes.reserve(sprites.size());
-  for (const auto& sprite : sprites) {
-    auto size = sprite.bounds;
-    size.x += sheet.shape_padding;
-    size.y += sheet.shape_padding;
-    pack_sizes.push_back({ to_int(pack_sizes.size()), size.x, size.y });
-  }
-
-  const auto [max_width, max_height] = get_slice_max_size(sheet);
-  const auto pack_sheets = pack(
-    rect_pack::Settings{
-      (fast ? rect_pack::Method::Best_Skyline : rect_pack::Method::Best),
-      get_max_slice_count(sheet),
-      sheet.power_of_two,
-      sheet.square,
-      sheet.allow_rotate,
-      sheet.divisible_width,
-      sheet.border_padding,
-      sheet.shape_padding,
-      sheet.width,
-      sheet.height,
-      max_width,
-      max_height,
-    },
-    std::move(pack_sizes));
-
-  // update sprite rects
-  auto slice_index = 0;
-  for (const auto& pack_sheet : pack_sheets) {
-    for (const auto& pack_rect : pack_sheet.rects) {
-      auto& sprite = sprites[to_unsigned(pack_rect.id)];
-      sprite.rotated = pack_rect.rotated;
-      sprite.slice_index = slice_index;
-      sprite.trimmed_rect.x = pack_rect.x;
-      sprite.trimmed_rect.y = pack_rect.y;
-    }
-    ++slice_index;
-  }
-  create_slices_from_indices(sheet_ptr, sprites, slices);
+  auto input = PackInput{ };
+  input.sizes = get_pack_sizes(sheet, sprites);
+  input.settings = get_pack_settings(sheet, rect_pack::Method::Best);
+  const auto blocks = get_size_class_blocks(input.settings, input.sizes);
+  if (!blocks.empty())
+    input.sizes = get_block_sizes(blocks);
+  for (const auto& size : input.sizes)
+    input.rects_area += int64_t{ size.width } * size.height;
+
+  const auto methods = get_candidate_methods(input, fast);
+  auto pack_sheets = (sheet.pack_time > 0 ?
+    pack_anytime(input, methods, sheet.pack_time) :
+    pack_racing(input, methods).sheets);
+  if (!blocks.empty())
+    expand_blocks(blocks, pack_sheets);
+  apply_pack_sheets(sheet_ptr, sprites, pack_sheets, slices);
 }
 
 } // namespace
@@ -1,6 +1,9 @@
 
 #include "packing.h"
 #include "chipmunk/chipmunk.h"
+extern "C" {
+#include "chipmunk/cpPolyline.h"
+}
 
 namespace spright {
 
@@ -11,6 +14,23 @@ namespace {
   using ShapePtr = std::unique_ptr<cpShape, FreeShape>;
   struct FreeBody { void operator()(cpBody* body) { cpBodyFree(body); } };
   using BodyPtr = std::unique_ptr<cpBody, FreeBody>;
+  struct FreePolylineSet { void operator()(cpPolylineSet* set) { cpPolylineSetFree(set, true); } };
+  using PolylineSetPtr = std::unique_ptr<cpPolylineSet, FreePolylineSet>;
+
+  // concave outlines are closed and wound like convex hulls
+  PolylineSetPtr get_convex_parts(const std::vector<cpVect>& vertices) {
+    const auto count = to_int(vertices.size());
+    if (count < 4 || cpAreaForPoly(count, vertices.data(), 0) <= 0)
+      return { };
+    auto line = static_cast<cpPolyline*>(cpcalloc(1,
+      sizeof(cpPolyline) + vertices.size() * sizeof(cpVect)));
+    line->capacity = count;
+    line->count = count;
+    std::copy(vertices.begin(), vertices.end(), line->verts);
+    auto parts = PolylineSetPtr(cpPolylineConvexDecomposition(line, 1.0));
+    cpPolylineFree(line);
+    return parts;
+  }
 
   void compact_sprites(const Slice& slice, int border_padding, int shape_padding) {
     auto space_ptr = SpacePtr(cpSpaceNew());
@@ -47,14 +67,61 @@ namespace {
             vertex = rotate_cw(vertex, sprite.trimmed_rect.h);
           return cpVect{ vertex.x, vertex.y };
         });
+      if (sprite.trim == Trim::polygon)
+        if (const auto parts = get_convex_parts(vertices)) {
+          for (auto j = 0; j < parts->count; ++j)
+            shapes.emplace_back(cpSpaceAddShape(space, cpPolyShapeNew(body,
+              parts->lines[j]->count, parts->lines[j]->verts,
+              cpTransformIdentity, padding)));
+          continue;
+        }
+
       shapes.emplace_back(cpSpaceAddShape(space, cpPolyShapeNew(body,
         to_int(vertices.size()), vertices.data(), cpTransformIdentity, padding)));
     }
 
-    // TODO: improve
-    for (auto i = 0; i < 1000; i++) {
-      cpSpaceSetGravity(space, cpVect{ 20.0 * ((i / 100) % 2 ? 1 : -1), -100 });
-      cpSpaceStep(space, 1.0 / 60);
+    // shapes are about the size of the sprites
+    auto average_size = real{ };
+    for (const auto& sprite : slice.sprites)
+      average_size += to_real(std::max(sprite.bounds.x, sprite.bounds.y));
+    average_size /= to_real(slice.sprites.size());
+    cpSpaceUseSpatialHash(space, std::max(average_size, 1.0),
+      10 * to_int(shapes.size()));
+
+    // alternate horizontal gravity, a phase ends when all bodies settled
+    // and it is converged when the positions did not change within a cycle
+    const auto max_phases = std::min(10 + to_int(slice.sprites.size()) / 20, 100);
+    const auto max_phase_steps = 100;
+    const auto min_phase_steps = 10;
+    const auto settled_velocity = 1.0;
+    const auto converged_distance = 0.5;
+    const auto get_max_velocity = [&]() {
+      auto max_velocity = 0.0;
+      for (const auto& body : bodies)
+        max_velocity = std::max(max_velocity,
+          cpvlength(cpBodyGetVelocity(body.get())));
+      return max_velocity;
+    };
+    auto cycle_positions = std::vector<cpVect>(bodies.size());
+    for (auto phase = 0; phase < max_phases; ++phase) {
+      cpSpaceSetGravity(space, cpVect{ 20.0 * (phase % 2 ? 1 : -1), -100 });
+      for (auto step = 0; step < max_phase_steps; ++step) {
+        cpSpaceStep(space, 1.0 / 60);
+        if (step >= min_phase_steps && get_max_velocity() < settled_velocity)
+          break;
+      }
+
+      if (phase % 2) {
+        auto converged = (phase > 1);
+        for (auto j = size_t{ }; j < bodies.size(); ++j) {
+          const auto position = cpBodyGetPosition(bodies[j].get());
+          if (cpvdist(position, cycle_positions[j]) > converged_distance)
+            converged = false;
+          cycle_positions[j] = position;
+        }
+        if (converged)
+          break;
+      }
     }
 
     auto i = 0u;
@@ -73,11 +140,16 @@ namespace {
 void pack_compact(const SheetPtr& sheet, SpriteSpan sprites,
     std::vector<Slice>& slices) {
   const auto fast = (sheet->allow_rotate == false);
+  const auto first_slice = slices.size();
   pack_binpack(sheet, sprites, slices, fast);
-  for (auto& slice : slices) {
+
+  // slices are independent and each one is simulated in its own space
+  scheduler.for_each_parallel([&](size_t index) {
+    auto& slice = slices[first_slice + index];
     recompute_slice_size(slice);
     compact_sprites(slice, sheet->border_padding, sheet->shape_padding);
-  }
+    recompute_slice_size(slice);
+  }, slices.size() - first_slice);
 }
 
 } // namespace
@@ -0,0 +1,100 @@
+
+#include "packing.h"
+#include <map>
+
+namespace spright {
+
+namespace {
+  const auto max_block_sprites = size_t{ 1024 };
+
+  // groups sizes of about the same width and height,
+  // clusters are split into chunks, which are packed independently
+  std::vector<std::vector<rect_pack::Size>> get_chunks(
+      const rect_pack::Settings& settings,
+      const std::vector<rect_pack::Size>& sizes) {
+    auto clusters = std::map<std::pair<int, int>, std::vector<rect_pack::Size>>();
+    for (const auto& size : sizes) {
+      auto w = size.width;
+      auto h = size.height;
+      if (settings.allow_rotate && h > w)
+        std::swap(w, h);
+      clusters[{ floor_log2(h), floor_log2(w) }].push_back(size);
+    }
+
+    auto chunks = std::vector<std::vector<rect_pack::Size>>();
+    for (auto& [size_class, cluster] : clusters) {
+      const auto count = (cluster.size() + max_block_sprites - 1) / max_block_sprites;
+      const auto chunk_size = (cluster.size() + count - 1) / count;
+      for (auto begin = size_t{ }; begin < cluster.size(); begin += chunk_size) {
+        const auto end = std::min(begin + chunk_size, cluster.size());
+        chunks.emplace_back(cluster.begin() + static_cast<std::ptrdiff_t>(begin),
+          cluster.begin() + static_cast<std::ptrdiff_t>(end));
+      }
+    }
+    return chunks;
+  }
+
+  rect_pack::Settings get_block_settings(const rect_pack::Settings& settings) {
+    auto block_settings = rect_pack::Settings{ };
+    block_settings.method = settings.method;
+    block_settings.allow_rotate = settings.allow_rotate;
+    block_settings.over_allocate = settings.over_allocate;
+    if (settings.max_width > 0)
+      block_settings.max_width = settings.max_width - 2 * settings.border_padding;
+    if (settings.max_height > 0)
+      block_settings.max_height = settings.max_height - 2 * settings.border_padding;
+    return block_settings;
+  }
+} // namespace
+
+// Sizes are clustered by size class and each cluster is packed into
+// blocks concurrently, which are then packed onto the sheets. Trades
+// some density for near-linear scaling with the number of cores.
+std::vector<rect_pack::Sheet> pack_hierarchical(
+    const rect_pack::Settings& settings,
+    const std::vector<rect_pack::Size>& sizes) {
+  const auto chunks = get_chunks(settings, sizes);
+  const auto block_settings = get_block_settings(settings);
+  auto chunk_blocks = std::vector<std::vector<rect_pack::Sheet>>(chunks.size());
+  scheduler.for_each_parallel([&](size_t index) {
+    chunk_blocks[index] = pack_skyline(block_settings, chunks[index]);
+  }, chunks.size());
+
+  auto blocks = std::vector<rect_pack::Sheet>();
+  for (auto& chunk : chunk_blocks)
+    std::move(chunk.begin(), chunk.end(), std::back_inserter(blocks));
+
+  // blocks keep the padding apart like the sizes and are not rotated
+  auto block_sizes = std::vector<rect_pack::Size>();
+  block_sizes.reserve(blocks.size());
+  for (const auto& block : blocks)
+    block_sizes.push_back({ to_int(block_sizes.size()),
+      block.width + settings.over_allocate,
+      block.height + settings.over_allocate });
+  auto sheet_settings = settings;
+  sheet_settings.allow_rotate = false;
+  auto sheets = pack_skyline(sheet_settings, block_sizes);
+
+  for (auto& sheet : sheets) {
+    auto rects = std::vector<rect_pack::Rect>();
+    for (const auto& block_rect : sheet.rects)
+      for (auto rect : blocks[to_unsigned(block_rect.id)].rects) {
+        rect.x += block_rect.x;
+        rect.y += block_rect.y;
+        rects.push_back(rect);
+      }
+    sheet.rects = std::move(rects);
+  }
+  return sheets;
+}
+
+void pack_hierarchical(const SheetPtr& sheet_ptr, SpriteSpan sprites,
+    std::vector<Slice>& slices) {
+  const auto& sheet = *sheet_ptr;
+  const auto settings = get_pack_settings(sheet,
+    rect_pack::Method::Best_Skyline);
+  apply_pack_sheets(sheet_ptr, sprites,
+    pack_hierarchical(settings, get_pack_sizes(sheet, sprites)), slices);
+}
+
+} // namespace
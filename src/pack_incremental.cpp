@@ -0,0 +1,452 @@
+
+#include "packing.h"
+#include "nlohmann/json.hpp"
+#include <array>
+#include <fstream>
+#include <unordered_map>
+
+namespace spright {
+
+namespace {
+  struct PreviousRect {
+    int slice_index;
+    Rect trimmed_rect;
+    bool rotated;
+  };
+
+  // sprites are identified by their source and the rect on it,
+  // since ids may still contain unevaluated expressions while packing
+  std::string get_sprite_key(const std::filesystem::path& source,
+      const Rect& rect) {
+    auto ss = std::ostringstream();
+    ss << path_to_utf8(source) << ':' <<
+      rect.x << ',' << rect.y << ',' << rect.w << ',' << rect.h;
+    return ss.str();
+  }
+
+  Rect read_rect(const nlohmann::json& json) {
+    return {
+      json.at("x").get<int>(), json.at("y").get<int>(),
+      json.at("w").get<int>(), json.at("h").get<int>()
+    };
+  }
+
+  // ambiguous keys map to an empty optional
+  using PreviousLayout = std::map<std::string, std::optional<PreviousRect>>;
+
+  PreviousLayout read_previous_layout(const std::filesystem::path& filename) {
+    auto file = std::ifstream(filename);
+    if (!file.good())
+      return { };
+    const auto json = nlohmann::json::parse(file, nullptr, false);
+    if (json.is_discarded() || !json.is_object())
+      return { };
+
+    auto layout = PreviousLayout();
+    try {
+      auto sources = std::vector<std::filesystem::path>();
+      for (const auto& source : json.at("sources"))
+        sources.push_back(
+          utf8_to_path(source.at("path").get<std::string>()) /
+          utf8_to_path(source.at("filename").get<std::string>()));
+
+      for (const auto& sprite : json.at("sprites")) {
+        if (!sprite.contains("sliceIndex"))
+          continue;
+        const auto source_index = sprite.at("sourceIndex").get<size_t>();
+        const auto key = get_sprite_key(sources.at(source_index),
+          read_rect(sprite.at("sourceRect")));
+        auto previous = PreviousRect{
+          sprite.at("sliceIndex").get<int>(),
+          read_rect(sprite.at("trimmedRect")),
+          sprite.at("rotated").get<bool>(),
+        };
+        if (!layout.emplace(key, previous).second)
+          layout[key].reset();
+      }
+    }
+    catch (const nlohmann::json::exception&) {
+      return { };
+    }
+    return layout;
+  }
+
+  // free rects in grids of cells, so only the rects around a position
+  // need to be visited. Each rect is in the finest grid, where it covers
+  // only a few cells, the cells of each coarser grid are 8 times larger.
+  // Rects are also bucketed by the magnitude of their width and height,
+  // so only the buckets of rects which can hold a size are visited.
+  class FreeRectIndex {
+  public:
+    explicit FreeRectIndex(int cell_size)
+      : m_cell_size(std::max(cell_size, 1)) {
+    }
+
+    const Rect& operator[](size_t slot) const { return m_rects[slot]; }
+
+    void insert(const Rect& rect) {
+      auto slot = m_rects.size();
+      if (!m_unused_slots.empty()) {
+        slot = m_unused_slots.back();
+        m_unused_slots.pop_back();
+        m_rects[slot] = rect;
+      }
+      else {
+        m_rects.push_back(rect);
+        m_generations.push_back(0);
+        m_visited.push_back(0);
+      }
+      const auto entry = Entry{ slot, m_generations[slot] };
+      m_size_classes[get_size_class(floor_log2(rect.w), floor_log2(rect.h))].push_back(entry);
+
+      for (auto level = size_t{ }; ; ++level) {
+        if (level == m_levels.size())
+          m_levels.emplace_back();
+        const auto [x0, y0, x1, y1] = get_cells(rect, level);
+        if (int64_t{ x1 - x0 + 1 } * (y1 - y0 + 1) > max_cells_per_rect)
+          continue;
+        for (auto y = y0; y <= y1; ++y)
+          for (auto x = x0; x <= x1; ++x)
+            m_levels[level][get_key(x, y)].push_back(entry);
+        return;
+      }
+    }
+
+    // entries in cells and size classes are removed lazily
+    void erase(size_t slot) {
+      m_rects[slot] = { };
+      ++m_generations[slot];
+      m_unused_slots.push_back(slot);
+    }
+
+    // calls function for each rect which can hold the size
+    template<typename F> // F(size_t slot)
+    void for_each_holding(const Size& size, F&& function) {
+      const auto min_w = floor_log2(size.x);
+      const auto min_h = floor_log2(size.y);
+      for (auto w = min_w; w < max_log2; ++w)
+        for (auto h = min_h; h < max_log2; ++h)
+          for (auto slot : collect(m_size_classes[get_size_class(w, h)])) {
+            const auto& rect = m_rects[slot];
+            if (rect.w >= size.x && rect.h >= size.y)
+              function(slot);
+          }
+    }
+
+    std::vector<size_t> get_overlapping(const Rect& rect) {
+      ++m_visit;
+      auto slots = std::vector<size_t>();
+      for (auto level = size_t{ }; level < m_levels.size(); ++level) {
+        const auto [x0, y0, x1, y1] = get_cells(rect, level);
+        for (auto y = y0; y <= y1; ++y)
+          for (auto x = x0; x <= x1; ++x)
+            if (auto it = m_levels[level].find(get_key(x, y)); it != m_levels[level].end())
+              for (auto slot : collect(it->second))
+                if (m_visited[slot] != m_visit && overlapping(m_rects[slot], rect)) {
+                  m_visited[slot] = m_visit;
+                  slots.push_back(slot);
+                }
+      }
+      return slots;
+    }
+
+    // a rect containing another one also contains its top-left pixel
+    bool is_contained(const Rect& rect) {
+      for (auto slot : get_overlapping({ rect.x, rect.y, 1, 1 }))
+        if (containing(m_rects[slot], rect))
+          return true;
+      return false;
+    }
+
+  private:
+    static constexpr auto max_cells_per_rect = 64;
+    static constexpr auto level_scale = 8;
+    static constexpr auto max_log2 = 31;
+
+    struct Entry {
+      size_t slot;
+      uint32_t generation;
+    };
+
+    static size_t get_size_class(int log2_w, int log2_h) {
+      return to_unsigned(log2_w * max_log2 + log2_h);
+    }
+
+    // removes stale entries and returns the slots of the others
+    const std::vector<size_t>& collect(std::vector<Entry>& entries) {
+      m_collected.clear();
+      auto valid = entries.begin();
+      for (const auto& entry : entries)
+        if (entry.generation == m_generations[entry.slot]) {
+          *valid++ = entry;
+          m_collected.push_back(entry.slot);
+        }
+      entries.erase(valid, entries.end());
+      return m_collected;
+    }
+
+    std::tuple<int, int, int, int> get_cells(const Rect& rect, size_t level) const {
+      auto cell_size = int64_t{ m_cell_size };
+      for (auto i = size_t{ }; i < level; ++i)
+        cell_size *= level_scale;
+      const auto cell = [&](int value) {
+        return static_cast<int>(value / cell_size);
+      };
+      return { cell(rect.x), cell(rect.y), cell(rect.x1() - 1), cell(rect.y1() - 1) };
+    }
+
+    static uint64_t get_key(int x, int y) {
+      return (uint64_t{ to_unsigned(x) } << 32) | to_unsigned(y);
+    }
+
+    using Cells = std::unordered_map<uint64_t, std::vector<Entry>>;
+
+    int m_cell_size;
+    std::vector<Rect> m_rects;
+    std::vector<uint32_t> m_generations;
+    std::vector<uint32_t> m_visited;
+    uint32_t m_visit{ };
+    std::vector<size_t> m_unused_slots;
+    std::vector<Cells> m_levels;
+    std::array<std::vector<Entry>, max_log2 * max_log2> m_size_classes;
+    std::vector<size_t> m_collected;
+  };
+
+  // maintains the maximal free rectangles like MaxRects
+  struct FreeSpace {
+    FreeRectIndex free_rects;
+    int width{ };
+    int height{ };
+
+    FreeSpace(const Rect& area, int cell_size)
+      : free_rects(cell_size) {
+      free_rects.insert(area);
+    }
+
+    bool is_free(const Rect& rect) {
+      return free_rects.is_contained(rect);
+    }
+
+    void place(const Rect& used) {
+      auto split = std::vector<Rect>();
+      for (auto slot : free_rects.get_overlapping(used)) {
+        const auto free = free_rects[slot];
+        if (used.x > free.x)
+          split.push_back({ free.x, free.y, used.x - free.x, free.h });
+        if (used.x1() < free.x1())
+          split.push_back({ used.x1(), free.y, free.x1() - used.x1(), free.h });
+        if (used.y > free.y)
+          split.push_back({ free.x, free.y, free.w, used.y - free.y });
+        if (used.y1() < free.y1())
+          split.push_back({ free.x, used.y1(), free.w, free.y1() - used.y1() });
+        free_rects.erase(slot);
+      }
+
+      // remaining rects cannot be contained in a split one,
+      // since they were maximal before
+      auto added = std::vector<Rect>();
+      for (auto i = size_t{ }; i < split.size(); ++i) {
+        const auto& rect = split[i];
+        const auto contained = [&]() {
+          for (auto j = size_t{ }; j < split.size(); ++j)
+            if (j != i && containing(split[j], rect) &&
+                (split[j] != rect || j < i))
+              return true;
+          return free_rects.is_contained(rect);
+        };
+        if (!contained())
+          added.push_back(rect);
+      }
+      for (const auto& rect : added)
+        free_rects.insert(rect);
+
+      width = std::max(width, used.x1());
+      height = std::max(height, used.y1());
+    }
+  };
+
+  struct Placement {
+    int64_t growth;
+    size_t slice;
+    Rect rect;
+    bool rotated;
+  };
+
+  bool is_better(const Placement& a, const Placement& b) {
+    return std::tie(a.growth, a.slice, a.rect.y, a.rect.x) <
+           std::tie(b.growth, b.slice, b.rect.y, b.rect.x);
+  }
+
+  // applied to the sprites, once the layout is accepted
+  struct PlacedSprite {
+    size_t slice;
+    Point position;
+    bool rotated;
+  };
+} // namespace
+
+bool pack_incremental(const SheetPtr& sheet_ptr, SpriteSpan sprites,
+    std::vector<Slice>& slices) {
+  const auto& sheet = *sheet_ptr;
+  const auto previous = read_previous_layout(sheet.pack_incremental);
+  if (previous.empty())
+    return false;
+
+  const auto get_pack_size = [&](const Sprite& sprite, bool rotated) {
+    auto size = sprite.bounds;
+    if (rotated)
+      std::swap(size.x, size.y);
+    return Size{ size.x + sheet.shape_padding, size.y + sheet.shape_padding };
+  };
+
+  // find sprites which were on the same place before
+  auto kept = std::vector<std::pair<size_t, const PreviousRect*>>();
+  auto inserted = std::vector<size_t>();
+  auto slice_indices = std::map<int, size_t>();
+  auto sum_of_sizes = int64_t{ };
+  for (auto index = size_t{ }; index < sprites.size(); ++index) {
+    const auto& sprite = sprites[index];
+    const auto size = get_pack_size(sprite, false);
+    sum_of_sizes += std::max(size.x, size.y);
+
+    const auto it = previous.find(get_sprite_key(
+      sprite.source->path() / sprite.source->filename(), sprite.source_rect));
+    if (it != previous.end() && it->second.has_value() &&
+        it->second->trimmed_rect.size() == sprite.trimmed_source_rect.size() &&
+        (!it->second->rotated || sheet.allow_rotate)) {
+      kept.emplace_back(index, &*it->second);
+      slice_indices.emplace(it->second->slice_index, 0);
+    }
+    else {
+      inserted.push_back(index);
+    }
+  }
+  if (kept.empty())
+    return false;
+
+  // number previous slices of this sheet consecutively
+  auto slice_count = size_t{ };
+  for (auto& entry : slice_indices)
+    entry.second = slice_count++;
+
+  // the area available on each slice, unbounded slices can grow
+  // by the sum of all sprite sizes
+  const auto [max_width, max_height] = get_slice_max_size(sheet);
+  const auto reach = 2 * sheet.border_padding + sum_of_sizes;
+  const auto area = Rect{
+    sheet.border_padding,
+    sheet.border_padding,
+    static_cast<int>(std::min(int64_t{ max_width }, reach)) -
+      2 * sheet.border_padding + sheet.shape_padding,
+    static_cast<int>(std::min(int64_t{ max_height }, reach)) -
+      2 * sheet.border_padding + sheet.shape_padding,
+  };
+  if (area.w <= 0 || area.h <= 0)
+    return false;
+  const auto cell_size = 2 * static_cast<int>(
+    sum_of_sizes / to_int(sprites.size()));
+  auto spaces = std::vector<FreeSpace>(slice_count,
+    FreeSpace(area, cell_size));
+
+  // keep sprites in order of their previous position,
+  // insert the ones which do no longer fit
+  std::sort(kept.begin(), kept.end(), [](const auto& a, const auto& b) {
+    const auto& ra = *a.second;
+    const auto& rb = *b.second;
+    return std::tie(ra.slice_index, ra.trimmed_rect.y, ra.trimmed_rect.x) <
+           std::tie(rb.slice_index, rb.trimmed_rect.y, rb.trimmed_rect.x);
+  });
+  auto placed = std::vector<PlacedSprite>(sprites.size());
+  for (const auto& [index, previous_rect] : kept) {
+    const auto& sprite = sprites[index];
+    const auto size = get_pack_size(sprite, previous_rect->rotated);
+    const auto rect = Rect{
+      previous_rect->trimmed_rect.x - sprite.align.x,
+      previous_rect->trimmed_rect.y - sprite.align.y,
+      size.x, size.y
+    };
+    const auto slice = slice_indices[previous_rect->slice_index];
+    auto& space = spaces[slice];
+    if (!space.is_free(rect)) {
+      inserted.push_back(index);
+      continue;
+    }
+    space.place(rect);
+    placed[index] = { slice, { rect.x, rect.y }, previous_rect->rotated };
+  }
+
+  // insert largest sprites first where the slices grow the least
+  std::sort(inserted.begin(), inserted.end(),
+    [&](size_t index_a, size_t index_b) {
+      const auto& a = sprites[index_a];
+      const auto& b = sprites[index_b];
+      const auto area_a = int64_t{ a.bounds.x } * a.bounds.y;
+      const auto area_b = int64_t{ b.bounds.x } * b.bounds.y;
+      return std::tie(area_b, a.index) < std::tie(area_a, b.index);
+    });
+  for (auto index : inserted) {
+    const auto& sprite = sprites[index];
+    auto best = std::optional<Placement>();
+    for (auto slice = size_t{ }; slice < spaces.size(); ++slice) {
+      auto& space = spaces[slice];
+      const auto current = int64_t{ space.width } * space.height;
+      for (auto rotated : { false, true }) {
+        if (rotated && !sheet.allow_rotate)
+          break;
+        const auto size = get_pack_size(sprite, rotated);
+        space.free_rects.for_each_holding(size, [&](size_t slot) {
+          const auto& free = space.free_rects[slot];
+          const auto rect = Rect{ free.x, free.y, size.x, size.y };
+          const auto growth =
+            int64_t{ std::max(space.width, rect.x1()) } *
+              std::max(space.height, rect.y1()) - current;
+          const auto placement = Placement{ growth, slice, rect, rotated };
+          if (!best || is_better(placement, *best))
+            best = placement;
+        });
+      }
+    }
+    if (!best)
+      return false;
+
+    spaces[best->slice].place(best->rect);
+    placed[index] = { best->slice, { best->rect.x, best->rect.y }, best->rotated };
+  }
+
+  // fall back to packing from scratch, when too much space is wasted
+  auto slice_sprite_area = std::vector<int64_t>(spaces.size());
+  for (auto index = size_t{ }; index < sprites.size(); ++index)
+    slice_sprite_area[placed[index].slice] +=
+      int64_t{ sprites[index].bounds.x } * sprites[index].bounds.y;
+  auto used_slices = std::vector<int>(spaces.size(), -1);
+  auto used_slice_count = 0;
+  for (auto slice = size_t{ }; slice < spaces.size(); ++slice) {
+    if (!slice_sprite_area[slice])
+      continue;
+    const auto& space = spaces[slice];
+    const auto slice_area = to_real(space.width + sheet.border_padding) *
+      to_real(space.height + sheet.border_padding);
+    if (1 - to_real(slice_sprite_area[slice]) / slice_area >
+          sheet.max_fragmentation)
+      return false;
+    used_slices[slice] = used_slice_count++;
+  }
+
+  // omit slices which became empty
+  for (auto index = size_t{ }; index < sprites.size(); ++index) {
+    auto& sprite = sprites[index];
+    const auto& placement = placed[index];
+    sprite.slice_index = used_slices[placement.slice];
+    sprite.trimmed_rect.x = placement.position.x;
+    sprite.trimmed_rect.y = placement.position.y;
+    sprite.rotated = placement.rotated;
+  }
+
+  auto incremental_slices = std::vector<Slice>();
+  create_slices_from_indices(sheet_ptr, sprites, incremental_slices);
+  slices.insert(slices.end(),
+    incremental_slices.begin(), incremental_slices.end());
+  return true;
+}
+
+} // namespace
@@ -0,0 +1,252 @@
+
+#include "packing.h"
+#include <numeric>
+
+namespace spright {
+
+namespace {
+  // rows of bits, with one word of spare bits at the end of each row
+  class Bitmap {
+  public:
+    Bitmap() = default;
+    Bitmap(int width, int height)
+      : m_width(width), m_height(height),
+        m_words_per_row(to_unsigned(width / 64 + 2)),
+        m_words(m_words_per_row * to_unsigned(height)) {
+    }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    size_t words_per_row() const { return m_words_per_row; }
+
+    void resize_height(int height) {
+      m_height = height;
+      m_words.resize(m_words_per_row * to_unsigned(height));
+    }
+
+    bool get(int x, int y) const {
+      return (row(y)[to_unsigned(x / 64)] >> (x % 64)) & 1u;
+    }
+
+    void set(int x, int y) {
+      row(y)[to_unsigned(x / 64)] |= uint64_t{ 1 } << (x % 64);
+    }
+
+    const uint64_t* row(int y) const {
+      return m_words.data() + to_unsigned(y) * m_words_per_row;
+    }
+
+    uint64_t* row(int y) {
+      return m_words.data() + to_unsigned(y) * m_words_per_row;
+    }
+
+  private:
+    int m_width{ };
+    int m_height{ };
+    size_t m_words_per_row{ };
+    std::vector<uint64_t> m_words;
+  };
+
+  // the sprite's visible pixels and the same dilated by the padding,
+  // the dilated mask's top-left is the sprite's top-left
+  struct Mask {
+    Bitmap pixels;
+    Bitmap dilated;
+    // first/last row per column of the dilated/undilated mask
+    std::vector<int> dilated_top;
+    std::vector<int> bottom;
+    int64_t count{ };
+  };
+
+  Mask create_mask(const Sprite& sprite, int padding) {
+    const auto [w, h] = sprite.bounds;
+    auto mask = Mask{ Bitmap(w, h), Bitmap(w + 2 * padding, h + 2 * padding) };
+    if (sprite.extrude.count) {
+      for (auto y = 0; y < h; ++y)
+        for (auto x = 0; x < w; ++x)
+          mask.pixels.set(x, y);
+    }
+    else {
+      const auto& rect = sprite.trimmed_source_rect;
+      const auto view = ImageView(*sprite.source, rect);
+      for (auto y = 0; y < rect.h; ++y) {
+        const auto row = view.row(rect.y + y);
+        for (auto x = 0; x < rect.w; ++x)
+          if (row[rect.x + x].a)
+            mask.pixels.set(sprite.align.x + x, sprite.align.y + y);
+      }
+    }
+
+    // dilate horizontally, then vertically
+    auto horizontal = Bitmap(w + 2 * padding, h);
+    for (auto y = 0; y < h; ++y)
+      for (auto x = 0; x < w; ++x)
+        if (mask.pixels.get(x, y)) {
+          ++mask.count;
+          for (auto i = 0; i <= 2 * padding; ++i)
+            horizontal.set(x + i, y);
+        }
+    for (auto y = 0; y < h; ++y)
+      for (auto x = 0; x < horizontal.width(); ++x)
+        if (horizontal.get(x, y))
+          for (auto i = 0; i <= 2 * padding; ++i)
+            mask.dilated.set(x, y + i);
+
+    mask.dilated_top.resize(to_unsigned(mask.dilated.width()),
+      std::numeric_limits<int>::max());
+    for (auto y = mask.dilated.height() - 1; y >= 0; --y)
+      for (auto x = 0; x < mask.dilated.width(); ++x)
+        if (mask.dilated.get(x, y))
+          mask.dilated_top[to_unsigned(x)] = y;
+
+    mask.bottom.resize(to_unsigned(w), -1);
+    for (auto y = 0; y < h; ++y)
+      for (auto x = 0; x < w; ++x)
+        if (mask.pixels.get(x, y))
+          mask.bottom[to_unsigned(x)] = y;
+    return mask;
+  }
+
+  // tests 64 columns at once, rows beyond the occupied height are empty
+  bool collides(const Bitmap& occupied, const Bitmap& mask, int x, int y) {
+    const auto words = to_int(mask.words_per_row());
+    const auto rows = std::min(mask.height(), occupied.height() - y);
+    for (auto r = 0; r < rows; ++r) {
+      const auto source = mask.row(r);
+      const auto target = occupied.row(y + r) + x / 64;
+      const auto shift = x % 64;
+      for (auto i = 0; i < words - 1; ++i) {
+        const auto bits = source[i];
+        if (!bits)
+          continue;
+        if (target[i] & (bits << shift))
+          return true;
+        if (shift && (target[i + 1] & (bits >> (64 - shift))))
+          return true;
+      }
+    }
+    return false;
+  }
+
+  void place(Bitmap& occupied, const Bitmap& mask, int x, int y) {
+    if (occupied.height() < y + mask.height())
+      occupied.resize_height(y + mask.height());
+    const auto words = to_int(mask.words_per_row());
+    const auto shift = x % 64;
+    for (auto r = 0; r < mask.height(); ++r) {
+      const auto source = mask.row(r);
+      const auto target = occupied.row(y + r) + x / 64;
+      for (auto i = 0; i < words - 1; ++i) {
+        target[i] |= (source[i] << shift);
+        if (shift)
+          target[i + 1] |= (source[i] >> (64 - shift));
+      }
+    }
+  }
+
+  int get_sheet_width(const Sheet& sheet, const std::vector<Mask>& masks,
+      SpriteSpan sprites) {
+    const auto [max_width, max_height] = get_slice_max_size(sheet);
+    if (sheet.width > 0)
+      return max_width;
+
+    // aim for a square sheet, expecting the sprites to interlock a bit
+    auto area = real{ };
+    auto widest = 0;
+    for (auto i = size_t{ }; i < masks.size(); ++i) {
+      const auto [w, h] = sprites[i].bounds;
+      area += (to_real((w + sheet.shape_padding) * (h + sheet.shape_padding)) +
+        to_real(masks[i].count)) / 2;
+      widest = std::max(widest, w);
+    }
+    const auto width = std::max(widest,
+      static_cast<int>(std::ceil(std::sqrt(area)))) + 2 * sheet.border_padding;
+    return std::min(width, max_width);
+  }
+} // namespace
+
+void pack_pixels(const SheetPtr& sheet_ptr, SpriteSpan sprites,
+    std::vector<Slice>& slices) {
+  const auto& sheet = *sheet_ptr;
+  const auto padding = sheet.shape_padding;
+
+  auto masks = std::vector<Mask>(sprites.size());
+  scheduler.for_each_parallel([&](size_t index) {
+    masks[index] = create_mask(sprites[index], padding);
+  }, sprites.size());
+
+  const auto [max_width, max_height] = get_slice_max_size(sheet);
+  const auto width = get_sheet_width(sheet, masks, sprites) -
+    2 * sheet.border_padding;
+  const auto height = int64_t{ max_height } - 2 * sheet.border_padding;
+
+  // place largest first
+  auto remaining = std::vector<size_t>(sprites.size());
+  std::iota(remaining.begin(), remaining.end(), size_t{ });
+  std::sort(remaining.begin(), remaining.end(), [&](size_t a, size_t b) {
+    const auto area_a = int64_t{ sprites[a].bounds.x } * sprites[a].bounds.y;
+    const auto area_b = int64_t{ sprites[b].bounds.x } * sprites[b].bounds.y;
+    return std::tie(area_b, a) < std::tie(area_a, b);
+  });
+
+  const auto max_slices = get_max_slice_count(sheet);
+  for (auto slice_index = 0; !remaining.empty() &&
+      (max_slices <= 0 || slice_index < max_slices); ++slice_index) {
+    // occupied pixels have a margin of the padding on each side,
+    // so the dilated masks can be placed at the sprite's position
+    auto occupied = Bitmap(width + 2 * padding, 0);
+    auto skyline = std::vector<int>(to_unsigned(occupied.width()));
+    auto deferred = std::vector<size_t>();
+    for (auto index : remaining) {
+      const auto& sprite = sprites[index];
+      const auto& mask = masks[index];
+      const auto [w, h] = sprite.bounds;
+
+      // rest on skyline or sink into the holes above it
+      auto best = std::optional<Point>();
+      for (auto x = 0; x + w <= width; ++x) {
+        auto y_skyline = 0;
+        for (auto c = 0; c < mask.dilated.width(); ++c)
+          if (mask.dilated_top[to_unsigned(c)] != std::numeric_limits<int>::max())
+            y_skyline = std::max(y_skyline,
+              skyline[to_unsigned(x + c)] - mask.dilated_top[to_unsigned(c)]);
+        if (best && y_skyline - h > best->y)
+          continue;
+
+        for (auto y = std::max(y_skyline - h, 0); y <= y_skyline; ++y) {
+          if (best && std::tie(y, x) >= std::tie(best->y, best->x))
+            break;
+          if (y == y_skyline || !collides(occupied, mask.dilated, x, y)) {
+            best = Point{ x, y };
+            break;
+          }
+        }
+      }
+      if (!best || best->y + h > height) {
+        deferred.push_back(index);
+        continue;
+      }
+
+      place(occupied, mask.pixels, best->x + padding, best->y + padding);
+      for (auto c = 0; c < w; ++c)
+        if (mask.bottom[to_unsigned(c)] >= 0) {
+          auto& top = skyline[to_unsigned(best->x + padding + c)];
+          top = std::max(top, best->y + padding + mask.bottom[to_unsigned(c)] + 1);
+        }
+
+      auto& placed = sprites[index];
+      placed.slice_index = slice_index;
+      placed.rotated = false;
+      placed.trimmed_rect.x = best->x + sheet.border_padding;
+      placed.trimmed_rect.y = best->y + sheet.border_padding;
+    }
+
+    // sprites which did not even fit on an empty slice
+    if (deferred.size() == remaining.size())
+      break;
+    remaining = std::move(deferred);
+  }
+  create_slices_from_indices(sheet_ptr, sprites, slices);
+}
+
+} // namespace
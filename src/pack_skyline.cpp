@@ -0,0 +1,240 @@
+
+#include "packing.h"
+#include <set>
+
+namespace spright {
+
+namespace {
+  constexpr auto wall = std::numeric_limits<int>::max();
+
+  // heights of the columns in a segment tree with lazy assignment,
+  // columns beyond the width are walls
+  class Skyline {
+  public:
+    explicit Skyline(int width) {
+      while (m_size < width)
+        m_size *= 2;
+      m_min.resize(2 * to_unsigned(m_size));
+      m_max.resize(2 * to_unsigned(m_size));
+      m_assign.resize(2 * to_unsigned(m_size), -1);
+      for (auto i = 0; i < m_size; ++i)
+        m_min[leaf(i)] = m_max[leaf(i)] = (i < width ? 0 : wall);
+      for (auto i = m_size - 1; i > 0; --i)
+        update(to_unsigned(i));
+    }
+
+    // lowest height and the leftmost column with it
+    std::pair<int, int> lowest() {
+      auto node = size_t{ 1 };
+      while (node < to_unsigned(m_size)) {
+        push(node);
+        node = (m_min[2 * node] == m_min[node] ? 2 * node : 2 * node + 1);
+      }
+      return { m_min[node], to_int(node) - m_size };
+    }
+
+    // first column at or right of x which is higher than height
+    int higher(int x, int height) {
+      return higher(1, 0, m_size, x, height);
+    }
+
+    int at(int x) {
+      auto node = size_t{ 1 };
+      for (auto begin = 0, end = m_size; end - begin > 1; ) {
+        push(node);
+        const auto center = (begin + end) / 2;
+        node *= 2;
+        if (x < center) {
+          end = center;
+        }
+        else {
+          begin = center;
+          node += 1;
+        }
+      }
+      return m_min[node];
+    }
+
+    void assign(int begin, int end, int height) {
+      assign(1, 0, m_size, begin, end, height);
+    }
+
+  private:
+    size_t leaf(int x) const { return to_unsigned(m_size + x); }
+
+    void update(size_t node) {
+      m_min[node] = std::min(m_min[2 * node], m_min[2 * node + 1]);
+      m_max[node] = std::max(m_max[2 * node], m_max[2 * node + 1]);
+    }
+
+    void set(size_t node, int height) {
+      m_min[node] = m_max[node] = height;
+      if (node < to_unsigned(m_size))
+        m_assign[node] = height;
+    }
+
+    void push(size_t node) {
+      if (m_assign[node] >= 0) {
+        set(2 * node, m_assign[node]);
+        set(2 * node + 1, m_assign[node]);
+        m_assign[node] = -1;
+      }
+    }
+
+    int higher(size_t node, int begin, int end, int x, int height) {
+      if (end <= x || m_max[node] <= height)
+        return end;
+      if (end - begin == 1)
+        return begin;
+      push(node);
+      const auto center = (begin + end) / 2;
+      const auto left = higher(2 * node, begin, center, x, height);
+      if (left < center)
+        return left;
+      return higher(2 * node + 1, center, end, x, height);
+    }
+
+    void assign(size_t node, int begin, int end,
+        int assign_begin, int assign_end, int height) {
+      if (assign_end <= begin || end <= assign_begin)
+        return;
+      if (assign_begin <= begin && end <= assign_end)
+        return set(node, height);
+      push(node);
+      const auto center = (begin + end) / 2;
+      assign(2 * node, begin, center, assign_begin, assign_end, height);
+      assign(2 * node + 1, center, end, assign_begin, assign_end, height);
+      update(node);
+    }
+
+    int m_size{ 1 };
+    std::vector<int> m_min;
+    std::vector<int> m_max;
+    std::vector<int> m_assign;
+  };
+
+  int get_sheet_width(const rect_pack::Settings& settings,
+      const std::vector<rect_pack::Size>& sizes) {
+    if (settings.min_width > 0 && settings.min_width == settings.max_width)
+      return settings.min_width;
+
+    // aim for a square sheet
+    auto area = real{ };
+    auto max_width = 0;
+    for (const auto& size : sizes) {
+      area += to_real(size.width) * to_real(size.height);
+      // rotated rects are placed lying, when they fit
+      max_width = std::max(max_width, (settings.allow_rotate ?
+        std::max(size.width, size.height) : size.width));
+    }
+    auto width = std::max(max_width,
+      static_cast<int>(std::ceil(std::sqrt(area)))) +
+      2 * settings.border_padding - settings.over_allocate;
+    if (settings.power_of_two)
+      width = ceil_to_pot(width);
+    if (settings.max_width > 0)
+      width = std::min(width, settings.max_width);
+    return std::max(width, settings.min_width);
+  }
+} // namespace
+
+// Best-fit strip packing: the widest rect which fits the lowest gap of
+// the skyline is placed, gaps where no rect fits are raised to the
+// lower neighbor. Rects are kept in an ordered set and the skyline
+// in a segment tree, so each step is O(log n).
+std::vector<rect_pack::Sheet> pack_skyline(
+    const rect_pack::Settings& settings,
+    const std::vector<rect_pack::Size>& sizes) {
+  const auto sheet_width = get_sheet_width(settings, sizes);
+  const auto width = sheet_width - 2 * settings.border_padding +
+    settings.over_allocate;
+  const auto max_height = (settings.max_height > 0 ?
+    int64_t{ settings.max_height } : int64_t{ wall });
+  const auto height = max_height - 2 * settings.border_padding +
+    settings.over_allocate;
+  if (width <= 0 || height <= 0)
+    return { };
+
+  // width, height, index of size
+  using Key = std::tuple<int, int, int>;
+  auto remaining = std::set<Key>();
+  auto rotated = std::vector<bool>(sizes.size());
+  for (auto i = size_t{ }; i < sizes.size(); ++i) {
+    auto w = sizes[i].width;
+    auto h = sizes[i].height;
+    if (settings.allow_rotate && h > w && h <= width) {
+      std::swap(w, h);
+      rotated[i] = true;
+    }
+    remaining.emplace(w, h, to_int(i));
+  }
+
+  auto sheets = std::vector<rect_pack::Sheet>();
+  while (!remaining.empty() && (settings.max_sheets <= 0 ||
+         to_int(sheets.size()) < settings.max_sheets)) {
+    auto& sheet = sheets.emplace_back();
+    auto skyline = Skyline(width);
+    auto deferred = std::set<Key>();
+    auto used_width = 0;
+    auto used_height = 0;
+    while (!remaining.empty()) {
+      const auto [y, x0] = skyline.lowest();
+      if (y >= height) {
+        deferred.merge(remaining);
+        break;
+      }
+      const auto x1 = std::min(skyline.higher(x0, y), width);
+      auto it = remaining.upper_bound({ x1 - x0, wall, wall });
+      if (it == remaining.begin()) {
+        // no rect fits into gap, raise it to the lower neighbor
+        const auto left = (x0 > 0 ? skyline.at(x0 - 1) : wall);
+        const auto right = (x1 < width ? skyline.at(x1) : wall);
+        if (left == wall && right == wall)
+          break;
+        skyline.assign(x0, x1, std::min(left, right));
+        continue;
+      }
+      const auto [w, h, index] = *std::prev(it);
+      remaining.erase(std::prev(it));
+      if (y + h > height) {
+        deferred.emplace(w, h, index);
+        continue;
+      }
+      skyline.assign(x0, x0 + w, y + h);
+      sheet.rects.push_back({ sizes[to_unsigned(index)].id,
+        x0 + settings.border_padding, y + settings.border_padding,
+        w, h, rotated[to_unsigned(index)] });
+      used_width = std::max(used_width, x0 + w - settings.over_allocate);
+      used_height = std::max(used_height, y + h - settings.over_allocate);
+    }
+
+    // rects which did not even fit on an empty sheet
+    if (sheet.rects.empty()) {
+      sheets.pop_back();
+      break;
+    }
+    sheet.width = std::max(settings.min_width,
+      used_width + 2 * settings.border_padding);
+    sheet.height = std::max(settings.min_height,
+      used_height + 2 * settings.border_padding);
+    if (settings.power_of_two) {
+      sheet.width = ceil_to_pot(sheet.width);
+      sheet.height = ceil_to_pot(sheet.height);
+    }
+    if (settings.square)
+      sheet.width = sheet.height = std::max(sheet.width, sheet.height);
+    remaining.merge(deferred);
+  }
+  return sheets;
+}
+
+void pack_skyline(const SheetPtr& sheet_ptr, SpriteSpan sprites,
+    std::vector<Slice>& slices) {
+  const auto& sheet = *sheet_ptr;
+  const auto settings = get_pack_settings(sheet,
+    rect_pack::Method::Best_Skyline);
+  apply_pack_sheets(sheet_ptr, sprites,
+    pack_skyline(settings, get_pack_sizes(sheet, sprites)), slices);
+}
+
+} // namespace
@@ -137,8 +137,13 @@ namespace {
       SpriteSpan sprites, std::vector<Slice>& slices) {
     assert(!sprites.empty());
 
+    if (sheet->pack == Pack::binpack &&
+        !sheet->pack_incremental.empty() &&
+        pack_incremental(sheet, sprites, slices))
+      return;
+
     switch (sheet->pack) {
-      case Pack::binpack: return pack_binpack(sheet, sprites, slices, sprites.size() > 1000);
+      case Pack::binpack: return pack_binpack(sheet, sprites, slices, false);
       case Pack::compact: return pack_compact(sheet, sprites, slices);
       case Pack::single: return pack_single(sheet, sprites, slices);
       case Pack::keep: return pack_keep(sheet, sprites, slices);
@@ -146,6 +151,9 @@ namespace {
       case Pack::columns: return pack_lines(sheet, sprites, slices, false);
       case Pack::origin: return pack_origin(sheet, sprites, slices, false);
       case Pack::layers: return pack_origin(sheet, sprites, slices, true);
+      case Pack::skyline: return pack_skyline(sheet, sprites, slices);
+      case Pack::pixels: return pack_pixels(sheet, sprites, slices);
+      case Pack::hierarchical: return pack_hierarchical(sheet, sprites, slices);
     }
   }
 
@@ -157,8 +165,9 @@ namespace {
     auto unique_sprites = sprites;
     for (auto i = sprites.size() - 1; ; --i) {
       for (auto j = size_t{ }; j < i; ++j) {
-        if (is_identical(*sprites[i].source, sprites[i].trimmed_source_rect,
-                         *sprites[j].source, sprites[j].trimmed_source_rect)) {
+        if (is_identical(
+              ImageView(*sprites[i].source, sprites[i].trimmed_source_rect),
+              ImageView(*sprites[j].source, sprites[j].trimmed_source_rect))) {
           sprites[i].duplicate_of_index = sprites[j].index;
           std::swap(sprites[i], unique_sprites.back());
           unique_sprites = unique_sprites.first(unique_sprites.size() - 1);
@@ -205,20 +214,30 @@ namespace {
                std::tie(b.sheet->index, b.index);
       });
 
-    auto slices = std::vector<Slice>();
+    auto sheet_sprites = std::vector<SpriteSpan>();
     for (auto begin = sprites.begin(), it = begin; ; ++it)
       if (it == sprites.end() ||
           it->sheet != begin->sheet) {
-        const auto& sheet = begin->sheet;
-        if (sheet->duplicates != Duplicates::keep)
-          pack_slice_deduplicate(sheet, { begin, it }, slices);
-        else
-          pack_slice(sheet, { begin, it }, slices);
-
+        sheet_sprites.emplace_back(begin, it);
         if (it == sprites.end())
           break;
         begin = it;
       }
+
+    // pack sheets concurrently and concatenate slices in sheet order
+    auto sheet_slices = std::vector<std::vector<Slice>>(sheet_sprites.size());
+    scheduler.for_each_parallel([&](size_t index) {
+      const auto& sprites = sheet_sprites[index];
+      const auto& sheet = sprites.front().sheet;
+      if (sheet->duplicates != Duplicates::keep)
+        pack_slice_deduplicate(sheet, sprites, sheet_slices[index]);
+      else
+        pack_slice(sheet, sprites, sheet_slices[index]);
+    }, sheet_sprites.size());
+
+    auto slices = std::vector<Slice>();
+    for (auto& packed : sheet_slices)
+      std::move(packed.begin(), packed.end(), std::back_inserter(slices));
     return slices;
   }
 } // namespace
@@ -322,6 +341,61 @@ void recompute_slice_size(Slice& slice) {
     slice.width = slice.height = std::max(slice.width, slice.height);
 }
 
+std::vector<rect_pack::Size> get_pack_sizes(const Sheet& sheet,
+    SpriteSpan sprites) {
+  auto sizes = std::vector<rect_pack::Size>();
+  sizes.reserve(sprites.size());
+  for (const auto& sprite : sprites)
+    sizes.push_back({ to_int(sizes.size()),
+      sprite.bounds.x + sheet.shape_padding,
+      sprite.bounds.y + sheet.shape_padding });
+  return sizes;
+}
+
+rect_pack::Settings get_pack_settings(const Sheet& sheet,
+    rect_pack::Method method) {
+  const auto [max_width, max_height] = get_slice_max_size(sheet);
+  return {
+    method,
+    get_max_slice_count(sheet),
+    sheet.power_of_two,
+    sheet.square,
+    sheet.allow_rotate,
+    sheet.divisible_width,
+    sheet.border_padding,
+    sheet.shape_padding,
+    sheet.width,
+    sheet.height,
+    max_width,
+    max_height,
+  };
+}
+
+void apply_pack_sheets(const SheetPtr& sheet_ptr, SpriteSpan sprites,
+    const std::vector<rect_pack::Sheet>& pack_sheets,
+    std::vector<Slice>& slices) {
+  auto slice_index = 0;
+  for (const auto& pack_sheet : pack_sheets) {
+    for (const auto& pack_rect : pack_sheet.rects) {
+      auto& sprite = sprites[to_unsigned(pack_rect.id)];
+      sprite.rotated = pack_rect.rotated;
+      sprite.slice_index = slice_index;
+      sprite.trimmed_rect.x = pack_rect.x;
+      sprite.trimmed_rect.y = pack_rect.y;
+    }
+    ++slice_index;
+  }
+  create_slices_from_indices(sheet_ptr, sprites, slices);
+}
+
+real get_slice_efficiency(const Slice& slice) {
+  auto used_area = real{ };
+  for (const auto& sprite : slice.sprites)
+    used_area += to_real(sprite.bounds.x) * to_real(sprite.bounds.y);
+  const auto area = to_real(slice.width) * to_real(slice.height);
+  return (area > 0 ? used_area / area : 0);
+}
+
 void update_last_source_written_times(std::vector<Slice>& slices) {
   scheduler.for_each_parallel(slices,
     [](Slice& slice) {
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "input.h"
+#include "rect_pack/rect_pack.h"
 
 #if __cplusplus > 201703L && __has_include(<span>)
 # include <span>
@@ -32,12 +33,34 @@ std::pair<int, int> get_slice_max_size(const Sheet& sheet);
 void create_slices_from_indices(const SheetPtr& sheet_ptr, 
     SpriteSpan sprites, std::vector<Slice>& slices);
 void recompute_slice_size(Slice& slice);
+std::vector<rect_pack::Size> get_pack_sizes(const Sheet& sheet,
+  SpriteSpan sprites);
+rect_pack::Settings get_pack_settings(const Sheet& sheet,
+  rect_pack::Method method);
+void apply_pack_sheets(const SheetPtr& sheet, SpriteSpan sprites,
+  const std::vector<rect_pack::Sheet>& pack_sheets,
+  std::vector<Slice>& slices);
+real get_slice_efficiency(const Slice& slice);
 void update_last_source_written_times(std::vector<Slice>& slices);
 
 std::vector<Slice> pack_sprites(std::vector<Sprite>& sprites);
 
 void pack_binpack(const SheetPtr& sheet, SpriteSpan sprites,
   std::vector<Slice>& slices, bool fast);
+bool pack_incremental(const SheetPtr& sheet, SpriteSpan sprites,
+  std::vector<Slice>& slices);
+void pack_skyline(const SheetPtr& sheet, SpriteSpan sprites,
+  std::vector<Slice>& slices);
+void pack_pixels(const SheetPtr& sheet, SpriteSpan sprites,
+  std::vector<Slice>& slices);
+void pack_hierarchical(const SheetPtr& sheet, SpriteSpan sprites,
+  std::vector<Slice>& slices);
+std::vector<rect_pack::Sheet> pack_skyline(
+  const rect_pack::Settings& settings,
+  const std::vector<rect_pack::Size>& sizes);
+std::vector<rect_pack::Sheet> pack_hierarchical(
+  const rect_pack::Settings& settings,
+  const std::vector<rect_pack::Size>& sizes);
 void pack_compact(const SheetPtr& sheet, SpriteSpan sprites,
   std::vector<Slice>& slices);
 void pack_single(const SheetPtr& sheet, SpriteSpan sprites,
@@ -3,7 +3,6 @@
 #include "chipmunk/chipmunk.h"
 extern "C" {
 #include "chipmunk/cpPolyline.h"
-#include "chipmunk/cpMarch.h"
 }
 
 namespace spright {
@@ -12,78 +11,6 @@ namespace {
   struct FreePolyline { void operator()(cpPolyline* line) { cpPolylineFree(line); }; };
   using PolylinePtr = std::unique_ptr<cpPolyline, FreePolyline>;
 
-  PolylinePtr merge_polylines(const cpPolylineSet& polyline_set) {
-    // TODO: find closest segments
-    // rotate vertices of one to begin at segment and delete end
-    // insert into other polyline at segment
-#if 0
-    auto count = 0;
-    for (auto i = 0; i < polyline_set.count; ++i)
-      count += polyline_set.lines[i]->count;
-
-    auto merged = PolylinePtr(static_cast<cpPolyline*>(cpcalloc(1,
-      sizeof(cpPolyline) + to_unsigned(count) * sizeof(cpVect))));
-    merged->capacity = count;
-    merged->count = count;
-
-    auto pos = merged->verts;
-    for (auto i = 0; i < polyline_set.count; ++i) {
-      auto line = polyline_set.lines[i];
-      std::copy(line->verts, line->verts + line->count, pos);
-      pos += line->count;
-    }
-#else
-    auto line = std::add_pointer_t<cpPolyline>{ };
-    for (auto i = 0; i < polyline_set.count; ++i)
-      if (!line || polyline_set.lines[i]->count > line->count)
-        line = polyline_set.lines[i];
-
-    auto merged = PolylinePtr(static_cast<cpPolyline*>(cpcalloc(1,
-      sizeof(cpPolyline) + to_unsigned(line->count) * sizeof(cpVect))));
-    merged->capacity = line->count;
-    merged->count = line->count;
-
-    std::copy(line->verts, line->verts + line->count, merged->verts);
-#endif
-    return merged;
-  }
-
-  PolylinePtr get_polygon_outline(const MonoImage& image, int threshold) {
-    const auto sample = [](cpVect point, void *data) -> cpFloat {
-      const auto& image = *static_cast<const MonoImage*>(data);
-      const auto x = to_int(point.x - 0.5);
-      const auto y = to_int(point.y - 0.5);
-      if (x < 0 || x >= image.width() || y < 0 || y >= image.height())
-        return 0;
-      return image.value_at({ x, y });
-    };
-
-    const auto outlines = cpPolylineSetNew();
-    cpMarchHard(
-      { -1, -1, to_real(image.width() + 1), to_real(image.height() + 1) },
-      to_unsigned(image.width() + 3),
-      to_unsigned(image.height() + 3),
-      threshold - 1,
-      reinterpret_cast<cpMarchSegmentFunc>(cpPolylineSetCollectSegment), outlines,
-      sample, const_cast<MonoImage*>(&image));
-
-    assert(outlines->count > 0);
-    const auto right = cpFloat(image.width());
-    const auto bottom = cpFloat(image.height());
-    for (auto i = 0; i < outlines->count; ++i) {
-      auto& line = *outlines->lines[i];
-      auto& verts = line.verts;
-      for (auto j = 0; j < line.count; ++j) {
-        verts[j].x = std::clamp(verts[j].x, cpFloat{ }, right);
-        verts[j].y = std::clamp(verts[j].y, cpFloat{ }, bottom);
-      }
-    }
-
-    auto outline = PolylinePtr(merge_polylines(*outlines));
-    cpPolylineSetFree(outlines, true);
-    return outline;
-  }
-
   cpVect normal(const cpVect& v) {
     if (auto f = v.x * v.x + v.y * v.y; f != 0.0) {
       f = 1.0 / std::sqrt(f);
@@ -92,24 +19,40 @@ namespace {
     return { 0, 0 };
   }
 
+  // limits the distance a vertex is moved at sharp corners
+  const auto max_miter_length = real{ 4 };
+
+  // moves each edge by distance along its normal, the vertices are moved
+  // along the bisector by distance / cos(half the angle between the normals)
   void expand_polygon(cpPolyline& polyline, real distance) {
-    if (distance == 0)
+    if (distance == 0 || polyline.count < 2)
       return;
-    distance /= 2;
+
+    // a closed polyline repeats the first vertex
+    const auto& first = polyline.verts[0];
+    const auto& last = polyline.verts[polyline.count - 1];
+    const auto closed = (first.x == last.x && first.y == last.y);
+    const auto count = to_unsigned(polyline.count - (closed ? 1 : 0));
 
     auto normals = std::vector<cpVect>();
-    normals.reserve(to_unsigned(polyline.count));
-    for (auto i = 0; i < polyline.count; ++i) {
+    normals.reserve(count);
+    for (auto i = size_t{ }; i < count; ++i) {
       const auto& p0 = polyline.verts[i];
-      const auto& p1 = polyline.verts[(i + 1) %  polyline.count];
+      const auto& p1 = polyline.verts[(i + 1) % count];
       normals.push_back(normal({ p1.x - p0.x, p1.y - p0.y }));
     }
-    for (auto i = size_t{ }; i < normals.size(); ++i) {
+    const auto min_cosine = 2 / (max_miter_length * max_miter_length);
+    for (auto i = size_t{ }; i < count; ++i) {
       const auto& n0 = normals[i];
-      const auto& n1 = normals[(i - 1 + normals.size()) % normals.size()];
-      polyline.verts[i].x += (n0.x + n1.x) * distance;
-      polyline.verts[i].y += (n0.y + n1.y) * distance;
+      const auto& n1 = normals[(i - 1 + count) % count];
+      // 1 + dot(n0, n1) is 2 * cos^2, |n0 + n1| is 2 * cos of half the angle
+      const auto scale = distance /
+        std::max(1 + n0.x * n1.x + n0.y * n1.y, min_cosine);
+      polyline.verts[i].x += (n0.x + n1.x) * scale;
+      polyline.verts[i].y += (n0.y + n1.y) * scale;
     }
+    if (closed)
+      polyline.verts[count] = polyline.verts[0];
   }
 
   PolylinePtr to_convex_polygon(const cpPolyline& polyline, real tolerance) {
@@ -117,11 +60,160 @@ namespace {
       const_cast<cpPolyline*>(&polyline), tolerance));
   }
 
+  using Outline = std::vector<Point>;
+
+  // traces the outlines of the pixels at or above threshold (marching squares),
+  // by walking along their edges, keeping the inside on the right hand side
+  std::vector<Outline> trace_outlines(const ChannelView& levels, int threshold) {
+    // binary mask with a border of outside pixels, 2 marks a visited top edge
+    const auto w = levels.width();
+    const auto h = levels.height();
+    const auto stride = w + 2;
+    auto mask = std::vector<uint8_t>(to_unsigned(stride * (h + 2)));
+    const auto& bounds = levels.bounds();
+    for (auto y = 0; y < h; ++y) {
+      const auto row = levels.row(bounds.y + y) + bounds.x;
+      const auto dest = mask.data() + (y + 1) * stride + 1;
+      for (auto x = 0; x < w; ++x)
+        dest[x] = (levels.value(row[x]) >= threshold ? 1 : 0);
+    }
+    const auto at = [&](int x, int y) -> uint8_t& {
+      return mask[to_unsigned((y + 1) * stride + x + 1)];
+    };
+
+    // step and offsets of the pixels ahead of a corner per direction
+    // right, down, left, up
+    const int step_x[] = { 1, 0, -1, 0 };
+    const int step_y[] = { 0, 1, 0, -1 };
+    const int ahead_left_x[] = { 0, 0, -1, -1 };
+    const int ahead_left_y[] = { -1, 0, 0, -1 };
+    const int ahead_right_x[] = { 0, -1, -1, 0 };
+    const int ahead_right_y[] = { 0, 0, -1, -1 };
+
+    auto outlines = std::vector<Outline>();
+    for (auto y = 0; y < h; ++y)
+      for (auto x = 0; x < w; ++x) {
+        if (at(x, y) != 1 || at(x, y - 1) != 0)
+          continue;
+
+        // start at top-left corner of an unvisited top edge, heading right
+        const auto start = Point{ x, y };
+        auto outline = Outline{ start };
+        auto p = start;
+        auto dir = 0;
+        for (;;) {
+          if (dir == 0)
+            at(p.x, p.y) = 2;
+          p.x += step_x[dir];
+          p.y += step_y[dir];
+          const auto i = to_unsigned(dir);
+          const auto next =
+            at(p.x + ahead_left_x[i], p.y + ahead_left_y[i]) ? (dir + 3) % 4 :
+            at(p.x + ahead_right_x[i], p.y + ahead_right_y[i]) ? dir :
+            (dir + 1) % 4;
+          if (p == start && next == 0)
+            break;
+          if (next != dir)
+            outline.push_back(p);
+          dir = next;
+        }
+        outlines.push_back(std::move(outline));
+      }
+    return outlines;
+  }
+
+  // twice the signed area, positive for outer outlines, negative for holes
+  int get_signed_area(const Outline& outline) {
+    auto area = 0;
+    for (auto i = size_t{ }, j = outline.size() - 1; i < outline.size(); j = i++)
+      area += outline[j].x * outline[i].y - outline[i].x * outline[j].y;
+    return area;
+  }
+
+  bool is_pixel_inside(const Outline& outline, const Point& pixel) {
+    const auto x = to_real(pixel.x) + 0.5;
+    const auto y = to_real(pixel.y) + 0.5;
+    auto inside = false;
+    for (auto i = size_t{ }, j = outline.size() - 1; i < outline.size(); j = i++) {
+      const auto& a = outline[i];
+      const auto& b = outline[j];
+      if ((a.y < y) != (b.y < y) &&
+          x < to_real(b.x - a.x) * (y - a.y) / to_real(b.y - a.y) + a.x)
+        inside = !inside;
+    }
+    return inside;
+  }
+
+  PolylinePtr to_polyline(const std::vector<Outline>& outlines, bool closed = false) {
+    auto count = size_t{ };
+    for (const auto& outline : outlines)
+      count += outline.size();
+    if (closed)
+      count += 1;
+
+    auto polyline = PolylinePtr(static_cast<cpPolyline*>(cpcalloc(1,
+      sizeof(cpPolyline) + count * sizeof(cpVect))));
+    polyline->capacity = to_int(count);
+    polyline->count = to_int(count);
+
+    auto pos = polyline->verts;
+    for (const auto& outline : outlines)
+      for (const auto& point : outline)
+        *pos++ = { to_real(point.x), to_real(point.y) };
+    if (closed)
+      *pos = polyline->verts[0];
+    return polyline;
+  }
+
+  PolylinePtr get_convex_outline(std::vector<Outline> outlines, const Size& size) {
+    if (outlines.empty())
+      outlines.push_back({ { 0, 0 }, { size.x, 0 }, { size.x, size.y }, { 0, size.y } });
+    return to_convex_polygon(*to_polyline(outlines), 0);
+  }
+
+  // returns the outer outline, when it encloses all islands
+  std::optional<Outline> get_concave_outline(std::vector<Outline> outlines) {
+    outlines.erase(std::remove_if(outlines.begin(), outlines.end(),
+      [](const Outline& outline) { return get_signed_area(outline) <= 0; }),
+      outlines.end());
+    if (outlines.empty())
+      return { };
+
+    auto largest = std::max_element(outlines.begin(), outlines.end(),
+      [](const Outline& a, const Outline& b) {
+        return get_signed_area(a) < get_signed_area(b);
+      });
+    // outlines begin at the top-left corner of their first pixel
+    for (const auto& outline : outlines)
+      if (&outline != &*largest && !is_pixel_inside(*largest, outline.front()))
+        return { };
+    return std::move(*largest);
+  }
+
   PolylinePtr simplify_polygon(const cpPolyline& polyline, real tolerance) {
     return PolylinePtr(cpPolylineSimplifyCurves(
       const_cast<cpPolyline*>(&polyline), tolerance));
   }
 
+  // increases tolerance until the closed polygon's vertex count is within budget
+  PolylinePtr simplify_polygon(const cpPolyline& polyline,
+      real& tolerance, int max_vertices) {
+    auto simplified = simplify_polygon(polyline, tolerance);
+    while (simplified->count - 1 > max_vertices) {
+      tolerance = std::max(tolerance * 1.5, 0.5);
+      simplified = simplify_polygon(polyline, tolerance);
+    }
+    return simplified;
+  }
+
+  void clamp_polygon(cpPolyline& polyline, const Size& size) {
+    for (auto i = 0; i < polyline.count; ++i) {
+      auto& vertex = polyline.verts[i];
+      vertex.x = std::clamp(vertex.x, cpFloat{ }, cpFloat(size.x));
+      vertex.y = std::clamp(vertex.y, cpFloat{ }, cpFloat(size.y));
+    }
+  }
+
   std::vector<PointF> to_point_list(const cpPolyline& polyline) {
     auto vertices = std::vector<PointF>();
     vertices.reserve(to_unsigned(polyline.count));
@@ -136,8 +228,9 @@ namespace {
   void trim_sprite(Sprite& sprite) {
     
     if (sprite.trim != Trim::none) {
-      sprite.trimmed_source_rect = get_used_bounds(*sprite.source,
-        sprite.trim_gray_levels, sprite.trim_threshold, sprite.source_rect);
+      sprite.trimmed_source_rect = sprite.source->used_pixels(
+        sprite.trim_gray_levels, sprite.trim_threshold).get_used_bounds(
+        sprite.source_rect);
   
       if (sprite.trim_margin)
         sprite.trimmed_source_rect = intersect(expand(
@@ -147,15 +240,30 @@ namespace {
       sprite.trimmed_source_rect = sprite.source_rect;
     }
 
-    if (sprite.trim == Trim::convex) {
-      const auto levels = (sprite.trim_gray_levels ?
-        get_gray_levels(*sprite.source, sprite.trimmed_source_rect) :
-        get_alpha_levels(*sprite.source, sprite.trimmed_source_rect));
+    if (sprite.trim == Trim::convex || sprite.trim == Trim::polygon) {
+      const auto levels = ChannelView(ImageView(*sprite.source,
+        sprite.trimmed_source_rect), sprite.trim_gray_levels);
+      const auto size = sprite.trimmed_source_rect.size();
+      auto outlines = trace_outlines(levels, sprite.trim_threshold);
+
+      if (sprite.trim == Trim::polygon)
+        if (auto concave = get_concave_outline(outlines)) {
+          auto tolerance = sprite.trim_tolerance;
+          auto outline = to_polyline({ *concave }, true);
+          outline = simplify_polygon(*outline, tolerance, sprite.trim_vertices);
+          if (outline->count > 3) {
+            // expand by tolerance to keep the pixels cut by simplification
+            expand_polygon(*outline, sprite.trim_margin + tolerance);
+            clamp_polygon(*outline, size);
+            sprite.vertices = to_point_list(*outline);
+            return;
+          }
+        }
 
-      auto outline = get_polygon_outline(levels, sprite.trim_threshold);
-      outline = to_convex_polygon(*outline, 0);
+      auto outline = get_convex_outline(std::move(outlines), size);
       outline = simplify_polygon(*outline, 3);
       expand_polygon(*outline, sprite.trim_margin);
+      clamp_polygon(*outline, size);
       sprite.vertices = to_point_list(*outline);
     }
     else {
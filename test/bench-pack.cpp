@@ -0,0 +1,244 @@
+
+#include "src/trimming.h"
+#include "src/packing.h"
+#include "nlohmann/json.hpp"
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+
+// Packs a corpus of sprite size distributions with every rect_pack method
+// and every pack mode, and reports time, efficiency and slice count as JSON.
+// usage: spright-bench-pack [max-count] [corpus-filter]
+
+using namespace spright;
+
+namespace {
+  struct SizeRange {
+    int count;
+    int min_width;
+    int min_height;
+    int max_width;
+    int max_height;
+    bool rotate;
+  };
+
+  struct Corpus {
+    const char* name;
+    std::vector<SizeRange> ranges;
+    bool allow_rotate;
+    int padding;
+    int max_size;
+  };
+
+  // how many rects a method can pack in reasonable time
+  struct Limited {
+    const char* name;
+    size_t max_count;
+  };
+
+  const auto corpora = std::vector<Corpus>{
+    { "ui", { { 200, 16, 16, 256, 128, false } }, false, 1, 2048 },
+    { "icons", { { 1000, 16, 16, 64, 64, true } }, true, 1, 2048 },
+    { "fonts", { { 5000, 4, 18, 14, 18, false } }, false, 1, 2048 },
+    { "characters", { { 2000, 96, 128, 96, 128, false },
+                      { 200, 64, 64, 128, 160, false } }, false, 2, 4096 },
+    { "particles", { { 20000, 2, 2, 16, 16, true } }, true, 1, 4096 },
+    { "tiles", { { 100000, 16, 16, 16, 16, false } }, false, 0, 4096 },
+    { "generated", { { 1000000, 1, 1, 8, 8, true } }, true, 1, 4096 },
+  };
+
+  const auto rect_pack_methods = std::vector<Limited>{
+    { "Best", 10000 },
+    { "Best_Skyline", 100000 },
+    { "Best_MaxRects", 10000 },
+    { "Skyline_BottomLeft", 100000 },
+    { "Skyline_BestFit", 100000 },
+    { "MaxRects_BestShortSideFit", 10000 },
+    { "MaxRects_BestLongSideFit", 10000 },
+    { "MaxRects_BestAreaFit", 10000 },
+    { "MaxRects_BottomLeftRule", 10000 },
+    { "MaxRects_ContactPointRule", 10000 },
+  };
+
+  // in order of enum Pack
+  const auto pack_modes = std::vector<Limited>{
+    { "binpack", 100000 },
+    { "rows", 100000 },
+    { "columns", 100000 },
+    { "compact", 500 },
+    { "origin", 100000 },
+    { "single", 10000 },
+    { "layers", 100000 },
+    { "keep", 100000 },
+    { "skyline", 100000 },
+    { "pixels", 5000 },
+    { "hierarchical", 100000 },
+  };
+
+  std::vector<rect_pack::Size> generate_sizes(const Corpus& corpus) {
+    auto rand = std::minstd_rand0();
+    const auto random = [&](int min, int max) -> int {
+      if (max <= min)
+        return max;
+      return min + static_cast<int>(rand() % to_unsigned(max - min + 1));
+    };
+    auto sizes = std::vector<rect_pack::Size>();
+    for (const auto& range : corpus.ranges)
+      for (auto i = 0; i < range.count; ++i) {
+        auto w = random(range.min_width, range.max_width);
+        auto h = random(range.min_height, range.max_height);
+        if (range.rotate && random(0, 1))
+          std::swap(w, h);
+        sizes.push_back({ to_int(sizes.size()), w, h });
+      }
+    return sizes;
+  }
+
+  template<typename F>
+  double measure_seconds(F&& function) {
+    using Clock = std::chrono::steady_clock;
+    const auto begin = Clock::now();
+    function();
+    return std::chrono::duration<double>(Clock::now() - begin).count();
+  }
+
+  nlohmann::json get_result(const Corpus& corpus, size_t count,
+      const std::string& method, double seconds, int64_t rects_area,
+      int64_t slices_area, size_t slice_count, size_t placed) {
+    auto result = nlohmann::json::object();
+    result["corpus"] = corpus.name;
+    result["count"] = count;
+    result["method"] = method;
+    result["seconds"] = seconds;
+    result["efficiency"] = (slices_area ?
+      static_cast<double>(rects_area) / static_cast<double>(slices_area) : 0.0);
+    result["slices"] = slice_count;
+    result["placed"] = placed;
+    return result;
+  }
+
+  nlohmann::json bench_rect_pack(const Corpus& corpus,
+      const std::vector<rect_pack::Size>& sizes, const std::string& name,
+      const std::function<std::vector<rect_pack::Sheet>(
+        const rect_pack::Settings&, const std::vector<rect_pack::Size>&)>& pack,
+      rect_pack::Method method) {
+    auto settings = rect_pack::Settings{ };
+    settings.method = method;
+    settings.allow_rotate = corpus.allow_rotate;
+    settings.over_allocate = corpus.padding;
+    settings.max_width = corpus.max_size;
+    settings.max_height = corpus.max_size;
+
+    auto padded = sizes;
+    for (auto& size : padded) {
+      size.width += corpus.padding;
+      size.height += corpus.padding;
+    }
+    auto sheets = std::vector<rect_pack::Sheet>();
+    const auto seconds = measure_seconds([&]() {
+      sheets = pack(settings, padded);
+    });
+
+    auto rects_area = int64_t{ };
+    auto sheets_area = int64_t{ };
+    auto placed = size_t{ };
+    for (const auto& sheet : sheets) {
+      sheets_area += int64_t{ sheet.width } * sheet.height;
+      for (const auto& rect : sheet.rects) {
+        const auto& size = sizes[to_unsigned(rect.id)];
+        rects_area += int64_t{ size.width } * size.height;
+      }
+      placed += sheet.rects.size();
+    }
+    return get_result(corpus, sizes.size(), name, seconds,
+      rects_area, sheets_area, sheets.size(), placed);
+  }
+
+  nlohmann::json bench_pack_mode(const Corpus& corpus,
+      const std::vector<rect_pack::Size>& sizes, Pack pack) {
+    auto sheet = std::make_shared<Sheet>();
+    sheet->pack = pack;
+    sheet->allow_rotate = corpus.allow_rotate;
+    sheet->shape_padding = corpus.padding;
+    sheet->max_width = corpus.max_size;
+    sheet->max_height = corpus.max_size;
+
+    auto max_size = 1;
+    for (const auto& size : sizes)
+      max_size = std::max({ max_size, size.width, size.height });
+    const auto source = std::make_shared<Image>(max_size, max_size,
+      RGBA{ { 255, 255, 255, 255 } });
+
+    auto sprites = std::vector<Sprite>(sizes.size());
+    for (auto i = size_t{ }; i < sizes.size(); ++i) {
+      auto& sprite = sprites[i];
+      sprite.index = to_int(i);
+      sprite.sheet = sheet;
+      sprite.source = source;
+      sprite.source_rect = { 0, 0, sizes[i].width, sizes[i].height };
+      sprite.trim = Trim::rect;
+      sprite.trim_threshold = 1;
+      sprite.divisible_bounds = { 1, 1 };
+    }
+    trim_sprites(sprites);
+
+    auto slices = std::vector<Slice>();
+    const auto seconds = measure_seconds([&]() {
+      slices = pack_sprites(sprites);
+    });
+
+    auto rects_area = int64_t{ };
+    auto slices_area = int64_t{ };
+    auto placed = size_t{ };
+    for (const auto& slice : slices) {
+      slices_area += int64_t{ slice.width } * slice.height;
+      for (const auto& sprite : slice.sprites)
+        rects_area += int64_t{ sprite.bounds.x } * sprite.bounds.y;
+      placed += slice.sprites.size();
+    }
+    return get_result(corpus, sizes.size(),
+      pack_modes[static_cast<size_t>(pack)].name, seconds,
+      rects_area, slices_area, slices.size(), placed);
+  }
+} // namespace
+
+int main(int argc, const char* argv[]) try {
+  const auto max_count = (argc > 1 ?
+    std::stoul(argv[1]) : std::numeric_limits<size_t>::max());
+  const auto filter = std::string(argc > 2 ? argv[2] : "");
+
+  auto results = nlohmann::json::array();
+  for (const auto& corpus : corpora) {
+    if (std::string_view(corpus.name).find(filter) == std::string::npos)
+      continue;
+    const auto sizes = generate_sizes(corpus);
+    if (sizes.size() > max_count)
+      continue;
+    std::cerr << corpus.name << " (" << sizes.size() << ")" << std::endl;
+
+    for (auto i = size_t{ }; i < rect_pack_methods.size(); ++i)
+      if (sizes.size() <= rect_pack_methods[i].max_count)
+        results.push_back(bench_rect_pack(corpus, sizes,
+          std::string("rect_pack ") + rect_pack_methods[i].name,
+          &rect_pack::pack, static_cast<rect_pack::Method>(i)));
+
+    using PackRects = std::vector<rect_pack::Sheet>(*)(
+      const rect_pack::Settings&, const std::vector<rect_pack::Size>&);
+    results.push_back(bench_rect_pack(corpus, sizes, "rects skyline",
+      static_cast<PackRects>(&pack_skyline), { }));
+    results.push_back(bench_rect_pack(corpus, sizes, "rects hierarchical",
+      static_cast<PackRects>(&pack_hierarchical), { }));
+
+    for (auto i = size_t{ }; i < pack_modes.size(); ++i)
+      if (sizes.size() <= pack_modes[i].max_count)
+        results.push_back(bench_pack_mode(corpus, sizes,
+          static_cast<Pack>(i)));
+  }
+  std::cout << results.dump(2) << std::endl;
+  return 0;
+}
+catch (const std::exception& ex) {
+  std::cerr << "ERROR: " << ex.what() << std::endl;
+  return 1;
+}
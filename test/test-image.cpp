@@ -0,0 +1,505 @@
+
+#include "catch.hpp"
+#include "src/image.h"
+#include "stb/stb_image.h"
+#include <atomic>
+#include <fstream>
+#include <random>
+
+using namespace spright;
+
+namespace {
+  Image generate_sources(int width, int height, int count, unsigned int seed) {
+    auto rand = std::minstd_rand0(seed);
+    auto image = Image(width, height, RGBA{ });
+    for (auto i = 0; i < count; ++i) {
+      const auto x = static_cast<int>(rand() % static_cast<unsigned int>(width));
+      const auto y = static_cast<int>(rand() % static_cast<unsigned int>(height));
+      // encode index in color, so source can be identified
+      image.rgba_at({ x, y }) = RGBA{ { static_cast<uint8_t>(i),
+        static_cast<uint8_t>(i >> 8), 1, 255 } };
+    }
+    return image;
+  }
+
+  int distance_sq(const Point& a, const Point& b) {
+    return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y);
+  }
+
+  // returns squared distance to bled color's source and to nearest source
+  std::pair<int, int> get_bleed_distances(const Image& image, const Point& p) {
+    auto nearest = std::numeric_limits<int>::max();
+    auto bled = -1;
+    const auto& color = image.rgba_at(p);
+    for (auto y = 0; y < image.height(); ++y)
+      for (auto x = 0; x < image.width(); ++x) {
+        const auto& source = image.rgba_at({ x, y });
+        if (source.a != 255)
+          continue;
+        const auto distance = distance_sq(p, { x, y });
+        nearest = std::min(nearest, distance);
+        if (source.r == color.r && source.g == color.g && source.b == color.b)
+          bled = distance;
+      }
+    return { bled, nearest };
+  }
+
+  struct Gif {
+    stbi_uc* pixels;
+    int* delays;
+    int width;
+    int height;
+    int frames;
+  };
+
+  Gif load_gif(const std::filesystem::path& filename) {
+    auto file = std::ifstream(filename, std::ios::binary);
+    const auto data = std::vector<char>(std::istreambuf_iterator<char>(file), { });
+    auto gif = Gif{ };
+    auto channels = 0;
+    gif.pixels = stbi_load_gif_from_memory(
+      reinterpret_cast<const stbi_uc*>(data.data()), static_cast<int>(data.size()),
+      &gif.delays, &gif.width, &gif.height, &gif.frames, &channels, 4);
+    return gif;
+  }
+
+  // unique file in the temporary directory, which is removed afterwards
+  class TempFile {
+  public:
+    explicit TempFile(const std::string& name)
+      : m_path(std::filesystem::temp_directory_path() / ("spright-" +
+          std::to_string(std::random_device()()) + "-" + name)) { }
+    TempFile(const TempFile&) = delete;
+    TempFile& operator=(const TempFile&) = delete;
+    ~TempFile() {
+      auto error = std::error_code();
+      std::filesystem::remove(m_path, error);
+    }
+    const std::filesystem::path& path() const { return m_path; }
+
+  private:
+    std::filesystem::path m_path;
+  };
+} // namespace
+
+TEST_CASE("image - bleed alpha") {
+  auto image = generate_sources(131, 77, 40, 1);
+  bleed_alpha(image);
+
+  for (auto y = 0; y < image.height(); ++y)
+    for (auto x = 0; x < image.width(); ++x) {
+      REQUIRE(image.rgba_at({ x, y }).b == 1);
+      const auto [bled, nearest] = get_bleed_distances(image, { x, y });
+      CHECK(bled == nearest);
+    }
+}
+
+TEST_CASE("image - bleed alpha limited") {
+  const auto max_distance = 3;
+  auto image = generate_sources(150, 140, 30, 2);
+  auto rects = std::vector<Rect>();
+  for (auto y = 0; y < image.height(); ++y)
+    for (auto x = 0; x < image.width(); ++x)
+      if (image.rgba_at({ x, y }).a)
+        rects.push_back({ x, y, 1, 1 });
+  bleed_alpha(image, rects, max_distance);
+
+  for (auto y = 0; y < image.height(); ++y)
+    for (auto x = 0; x < image.width(); ++x) {
+      const auto& color = image.rgba_at({ x, y });
+      auto nearest = std::numeric_limits<int>::max();
+      for (const auto& rect : rects)
+        nearest = std::min(nearest, distance_sq({ x, y }, rect.xy()));
+
+      if (nearest > max_distance * max_distance) {
+        CHECK(color.b == 0);
+      }
+      else {
+        REQUIRE(color.b == 1);
+        CHECK(get_bleed_distances(image, { x, y }).first == nearest);
+      }
+    }
+}
+
+TEST_CASE("image - views") {
+  auto image = Image(20, 10, RGBA{ });
+  image.rgba_at({ 12, 3 }) = RGBA{ { 0, 0, 0, 255 } };
+  image.rgba_at({ 15, 6 }) = RGBA{ { 255, 255, 255, 128 } };
+
+  const auto view = ImageView(image, { 10, 2, 8, 6 });
+  CHECK(view.rgba_at({ 12, 3 }).a == 255);
+  CHECK(get_used_bounds(view, false) == Rect{ 12, 3, 4, 4 });
+  CHECK(get_used_bounds(view, true) == Rect{ 15, 6, 1, 1 });
+  CHECK(is_fully_transparent(view.view({ 13, 2, 2, 6 })));
+  CHECK(!is_fully_transparent(view.view({ 13, 2, 3, 6 })));
+  CHECK(is_identical(view.view({ 12, 3, 1, 1 }), view.view({ 12, 3, 1, 1 })));
+  CHECK(!is_identical(view.view({ 12, 3, 1, 1 }), view.view({ 15, 6, 1, 1 })));
+  CHECK_THROWS(view.view({ 0, 0, 4, 4 }));
+
+  const auto levels = get_levels(ChannelView(view.view({ 12, 3, 4, 4 }), false));
+  CHECK(levels.value_at({ 0, 0 }) == 255);
+  CHECK(levels.value_at({ 3, 3 }) == 128);
+  CHECK(levels.value_at({ 1, 1 }) == 0);
+
+  const auto islands = find_islands(view, 0, false);
+  CHECK(islands.size() == 2);
+}
+
+TEST_CASE("image - find islands") {
+  auto image = Image(100, 700, RGBA{ });
+  const auto color = RGBA{ { 255, 255, 255, 255 } };
+  // vertical bar spanning multiple strips
+  fill_rect(image, { 10, 100, 1, 500 }, color);
+  // diagonal line crossing a strip seam
+  for (auto i = 0; i <= 30; ++i)
+    image.rgba_at({ 20 + i, 240 + i }) = color;
+  // U-shape, which is only connected below the seam
+  fill_rect(image, { 60, 200, 1, 100 }, color);
+  fill_rect(image, { 70, 200, 1, 100 }, color);
+  fill_rect(image, { 60, 300, 11, 1 }, color);
+  // two blocks within merge distance
+  fill_rect(image, { 70, 10, 5, 5 }, color);
+  fill_rect(image, { 78, 10, 5, 5 }, color);
+  // two blocks not within merge distance
+  fill_rect(image, { 70, 600, 5, 5 }, color);
+  fill_rect(image, { 80, 600, 5, 5 }, color);
+
+  auto islands = find_islands(image, 4, false);
+  const auto less = [](const Rect& a, const Rect& b) {
+    return std::tie(a.x, a.y, a.w, a.h) < std::tie(b.x, b.y, b.w, b.h);
+  };
+  std::sort(islands.begin(), islands.end(), less);
+  auto expected = std::vector<Rect>{
+    { 10, 100, 1, 500 },
+    { 20, 240, 31, 31 },
+    { 60, 200, 11, 101 },
+    { 70, 10, 13, 5 },
+    { 70, 600, 5, 5 },
+    { 80, 600, 5, 5 },
+  };
+  std::sort(expected.begin(), expected.end(), less);
+  CHECK(islands == expected);
+}
+
+TEST_CASE("image - used pixels") {
+  auto rand = std::minstd_rand0(3);
+  auto image = Image(37, 23, RGBA{ });
+  for (auto i = 0; i < 12; ++i) {
+    const auto x = static_cast<int>(rand() % 37u);
+    const auto y = static_cast<int>(rand() % 23u);
+    image.rgba_at({ x, y }) = RGBA{ { 0, 0, static_cast<uint8_t>(i * 20), 
+      static_cast<uint8_t>(i * 20) } };
+  }
+
+  for (auto gray_levels : { false, true })
+    for (auto threshold : { 1, 100 }) {
+      const auto& used = image.used_pixels(gray_levels, threshold);
+      CHECK(&used == &image.used_pixels(gray_levels, threshold));
+
+      for (auto h = 1; h < 23; h += 3)
+        for (auto w = 1; w < 37; w += 4)
+          for (auto y = 0; y + h <= 23; y += 2)
+            for (auto x = 0; x + w <= 37; x += 3) {
+              const auto rect = Rect{ x, y, w, h };
+              const auto view = ImageView(image, rect);
+              CHECK(used.is_empty(rect) == (gray_levels ?
+                is_fully_black(view, threshold) :
+                is_fully_transparent(view, threshold)));
+              CHECK(used.get_used_bounds(rect) == 
+                get_used_bounds(view, gray_levels, threshold));
+            }
+    }
+
+  // modifying the image discards the cached tables
+  image.rgba_at({ 0, 0 }) = RGBA{ };
+  CHECK(image.used_pixels(false, 1).is_empty({ 0, 0, 1, 1 }));
+  image.rgba_at({ 0, 0 }) = RGBA{ { 255, 255, 255, 255 } };
+  CHECK(!image.used_pixels(false, 1).is_empty({ 0, 0, 1, 1 }));
+}
+
+TEST_CASE("image - streamed animation") {
+  const auto colors = std::array<RGBA, 3>{ {
+    RGBA{ { 255, 0, 0, 255 } },
+    RGBA{ { 0, 255, 0, 255 } },
+    RGBA{ { 0, 0, 255, 255 } },
+  } };
+  auto animation = Animation();
+  animation.loop_count = 0;
+  for (auto i = 0; i < 10; ++i)
+    animation.frames.push_back({ i, 0.1 });
+
+  // frames are composed once for the palette and once for encoding
+  auto composed = std::atomic<int>();
+  animation.get_frame_image = [&](const Animation::Frame& frame) {
+    ++composed;
+    auto image = Image(30, 20, colors[0]);
+    fill_rect(image, { frame.index, 5, 10, 10 },
+      colors[to_unsigned(1 + frame.index % 2)]);
+    return image;
+  };
+  const auto temp_file = TempFile("animation.gif");
+  const auto& filename = temp_file.path();
+  save_animation(animation, filename);
+  CHECK(composed == 20);
+
+  // first frame
+  const auto image = Image(filename.parent_path(), filename.filename());
+  REQUIRE(image.width() == 30);
+  REQUIRE(image.height() == 20);
+  CHECK(image.rgba_at({ 0, 0 }) == colors[0]);
+  CHECK(image.rgba_at({ 5, 10 }) == colors[1]);
+}
+
+TEST_CASE("image - delta animation") {
+  const auto background = RGBA{ { 255, 255, 255, 255 } };
+  const auto foreground = RGBA{ { 255, 0, 0, 255 } };
+  auto animation = Animation();
+  animation.loop_count = 0;
+  animation.dither = Dither::none;
+  for (auto i = 0; i < 10; ++i)
+    animation.frames.push_back({ i, 0.1 });
+  // a rect moves every third frame
+  animation.get_frame_image = [&](const Animation::Frame& frame) {
+    auto image = Image(100, 80, background);
+    fill_rect(image, { 10 + frame.index / 3, 20, 10, 10 }, foreground);
+    return image;
+  };
+  const auto temp_file = TempFile("delta.gif");
+  const auto& filename = temp_file.path();
+  save_animation(animation, filename);
+
+  auto [pixels, delays, width, height, frames] = load_gif(filename);
+  REQUIRE(pixels);
+
+  // identical frames were merged
+  REQUIRE(frames == 4);
+  CHECK(delays[0] == 300);
+  CHECK(delays[3] == 100);
+  for (auto i = 0; i < frames; ++i) {
+    const auto frame = reinterpret_cast<const RGBA*>(pixels) + i * width * height;
+    const auto rgba_at = [&](int x, int y) { return frame[y * width + x]; };
+    CHECK(rgba_at(0, 0) == background);
+    CHECK(rgba_at(10 + i, 20) == foreground);
+    CHECK(rgba_at(10 + i + 10, 20) == background);
+    CHECK(rgba_at(10 + i + 9, 29) == foreground);
+    if (i > 0)
+      CHECK(rgba_at(10 + i - 1, 20) == background);
+  }
+  stbi_image_free(pixels);
+  stbi_image_free(delays);
+}
+
+TEST_CASE("image - long animation") {
+  // frames are encoded in batches
+  auto animation = Animation();
+  animation.loop_count = 0;
+  animation.dither = Dither::none;
+  for (auto i = 0; i < 50; ++i)
+    animation.frames.push_back({ i, 0.05 });
+  animation.get_frame_image = [&](const Animation::Frame& frame) {
+    auto image = Image(60, 60, RGBA{ { 0, 0, 0, 255 } });
+    fill_rect(image, { frame.index, frame.index, 10, 10 },
+      RGBA{ { 255, 255, 255, 255 } });
+    return image;
+  };
+  const auto temp_file = TempFile("long.gif");
+  const auto& filename = temp_file.path();
+  save_animation(animation, filename);
+
+  auto [pixels, delays, width, height, frames] = load_gif(filename);
+  REQUIRE(pixels);
+  REQUIRE(frames == 50);
+  for (auto i = 0; i < frames; ++i) {
+    const auto frame = reinterpret_cast<const RGBA*>(pixels) + i * width * height;
+    CHECK(delays[i] == 50);
+    CHECK(frame[i * width + i].r == 255);
+    CHECK(frame[(i + 10) * width + i + 10].r == 0);
+    if (i > 0)
+      CHECK(frame[(i - 1) * width + i - 1].r == 0);
+  }
+  stbi_image_free(pixels);
+  stbi_image_free(delays);
+}
+
+TEST_CASE("image - generate palette") {
+  // few distinct colors are reproduced exactly
+  auto image = Image(64, 64, RGBA{ });
+  fill_rect(image, { 0, 0, 48, 48 }, RGBA{ { 10, 20, 30, 255 } });
+  fill_rect(image, { 0, 0, 32, 32 }, RGBA{ { 200, 100, 50, 255 } });
+  fill_rect(image, { 10, 40, 5, 5 }, RGBA{ { 255, 255, 255, 255 } });
+  auto palette = generate_palette(image, 16);
+  CHECK(palette.size() == 4);
+  for (const auto& color : palette)
+    CHECK(std::count(image.rgba(), image.rgba() + 64 * 64, color) > 0);
+
+  // gradient is approximated closely
+  image = Image(256, 256);
+  for (auto y = 0; y < 256; ++y)
+    for (auto x = 0; x < 256; ++x)
+      image.rgba_at({ x, y }) = RGBA{ { static_cast<uint8_t>(x),
+        static_cast<uint8_t>(y), static_cast<uint8_t>(255 - x), 255 } };
+  palette = generate_palette(image, 64);
+  CHECK(palette.size() == 64);
+  const auto quantized = apply_palette(
+    quantize_image(image, palette, Dither::none), palette);
+  auto error = 0.0;
+  for (auto y = 0; y < 256; ++y)
+    for (auto x = 0; x < 256; ++x) {
+      const auto& a = image.rgba_at({ x, y });
+      const auto& b = quantized.rgba_at({ x, y });
+      error += std::abs(a.r - b.r) + std::abs(a.g - b.g) + std::abs(a.b - b.b);
+    }
+  CHECK(error / (256 * 256 * 3) < 8.5);
+}
+
+TEST_CASE("image - quantize image") {
+  auto rand = std::minstd_rand0(4);
+  const auto random_color = [&]() {
+    return RGBA{ { static_cast<uint8_t>(rand()), static_cast<uint8_t>(rand()),
+      static_cast<uint8_t>(rand()), 255 } };
+  };
+  auto palette = Palette();
+  for (auto i = 0; i < 200; ++i)
+    palette.push_back(random_color());
+
+  auto image = Image(100, 100);
+  for (auto y = 0; y < 100; ++y)
+    for (auto x = 0; x < 100; ++x)
+      image.rgba_at({ x, y }) = random_color();
+
+  // same as linear search for the closest color
+  const auto quantized = quantize_image(image, palette, Dither::none);
+  const auto distance = [](const RGBA& a, const RGBA& b) {
+    return (a.r - b.r) * (a.r - b.r) + (a.g - b.g) * (a.g - b.g) +
+      (a.b - b.b) * (a.b - b.b);
+  };
+  for (auto y = 0; y < 100; ++y)
+    for (auto x = 0; x < 100; ++x) {
+      const auto& color = image.rgba_at({ x, y });
+      auto min_distance = std::numeric_limits<int>::max();
+      for (const auto& entry : palette)
+        min_distance = std::min(min_distance, distance(entry, color));
+      CHECK(distance(palette[quantized.value_at({ x, y })], color) == min_distance);
+    }
+}
+
+TEST_CASE("image - dither image") {
+  auto palette = Palette();
+  for (auto i = 0; i < 8; ++i)
+    palette.push_back(RGBA{ { to_byte(i & 1 ? 255 : 0), to_byte(i & 2 ? 255 : 0),
+      to_byte(i & 4 ? 255 : 0), 255 } });
+
+  // large enough for rows being dithered concurrently
+  auto image = Image(512, 256, RGBA{ { 64, 64, 64, 255 } });
+  for (auto y = 0; y < 256; ++y)
+    for (auto x = 256; x < 512; ++x)
+      image.rgba_at({ x, y }) = RGBA{ { 160, 160, 160, 255 } };
+
+  const auto get_average = [&](const MonoImage& quantized, int x0, int x1) {
+    auto sum = 0;
+    for (auto y = 0; y < 256; ++y)
+      for (auto x = x0; x < x1; ++x)
+        sum += palette[quantized.value_at({ x, y })].r;
+    return sum / (256 * (x1 - x0));
+  };
+
+  const auto none = quantize_image(image, palette, Dither::none);
+  CHECK(get_average(none, 0, 256) == 0);
+  CHECK(get_average(none, 256, 512) == 255);
+
+  // dithering preserves the average brightness
+  for (auto dither : { Dither::floyd_steinberg, Dither::ordered }) {
+    const auto quantized = quantize_image(image, palette, dither);
+    CHECK(std::abs(get_average(quantized, 0, 256) - 64) <= 8);
+    CHECK(std::abs(get_average(quantized, 256, 512) - 160) <= 8);
+
+    // deterministic, even though rows are processed concurrently
+    const auto again = quantize_image(image, palette, dither);
+    CHECK(std::equal(quantized.data(), quantized.data() + 512 * 256, again.data()));
+  }
+}
+
+TEST_CASE("image - indexed png") {
+  const auto temp_file = TempFile("indexed.png");
+  const auto& filename = temp_file.path();
+  const auto read_header = [&]() {
+    auto file = std::ifstream(filename, std::ios::binary);
+    auto header = std::array<char, 29>();
+    file.read(header.data(), header.size());
+    // bit depth and color type
+    return std::make_pair(int{ header[24] }, int{ header[25] });
+  };
+
+  auto rand = std::minstd_rand0(5);
+  for (auto [colors, bit_depth] : { std::pair{ 2, 1 }, std::pair{ 3, 2 },
+      std::pair{ 16, 4 }, std::pair{ 200, 8 } }) {
+    auto image = Image(37, 23);
+    for (auto y = 0; y < image.height(); ++y)
+      for (auto x = 0; x < image.width(); ++x) {
+        const auto index = static_cast<int>(rand() % 
+          static_cast<unsigned int>(colors));
+        image.rgba_at({ x, y }) = RGBA{ { static_cast<uint8_t>(index), 10, 20,
+          static_cast<uint8_t>(index % 3 ? 255 : index) } };
+      }
+    save_image(image, filename);
+    CHECK(read_header() == std::make_pair(bit_depth, 3));
+
+    const auto loaded = Image(filename.parent_path(), filename.filename());
+    REQUIRE(loaded.width() == image.width());
+    REQUIRE(loaded.height() == image.height());
+    CHECK(std::equal(image.rgba(), image.rgba() + 37 * 23, loaded.rgba()));
+  }
+
+  // too many colors
+  auto image = Image(64, 64);
+  for (auto y = 0; y < 64; ++y)
+    for (auto x = 0; x < 64; ++x)
+      image.rgba_at({ x, y }) = RGBA{ { static_cast<uint8_t>(x * 4),
+        static_cast<uint8_t>(y * 4), 0, static_cast<uint8_t>(x < 8 ? 0 : 255) } };
+  save_image(image, filename);
+  CHECK(read_header() == std::make_pair(8, 6));
+
+  // quantized, transparent pixels stay transparent
+  save_image(image, filename, 16, Dither::none);
+  CHECK(read_header() == std::make_pair(4, 3));
+  const auto loaded = Image(filename.parent_path(), filename.filename());
+  CHECK(loaded.rgba_at({ 0, 0 }).a == 0);
+  CHECK(loaded.rgba_at({ 7, 63 }).a == 0);
+  CHECK(loaded.rgba_at({ 8, 0 }).a == 255);
+  CHECK(loaded.rgba_at({ 63, 63 }).a == 255);
+
+  // quantized, translucent pixels keep about their alpha
+  for (auto y = 0; y < 64; ++y)
+    for (auto x = 0; x < 64; ++x)
+      image.rgba_at({ x, y }).a = static_cast<uint8_t>(y < 32 ? 255 : (y - 32) * 8);
+  save_image(image, filename, 32, Dither::none);
+  CHECK(read_header() == std::make_pair(8, 3));
+  const auto translucent = Image(filename.parent_path(), filename.filename());
+  auto max_difference = 0;
+  for (auto y = 0; y < 64; ++y)
+    for (auto x = 0; x < 64; ++x)
+      max_difference = std::max(max_difference, std::abs(
+        translucent.rgba_at({ x, y }).a - image.rgba_at({ x, y }).a));
+  CHECK(max_difference <= 48);
+  CHECK(translucent.rgba_at({ 63, 0 }).a == 255);
+  CHECK(translucent.rgba_at({ 0, 32 }).a == 0);
+}
+
+TEST_CASE("image - png compressed in bands") {
+  // rows are deflated in multiple bands
+  auto rand = std::minstd_rand0(6);
+  auto image = Image(700, 300);
+  for (auto y = 0; y < image.height(); ++y)
+    for (auto x = 0; x < image.width(); ++x)
+      image.rgba_at({ x, y }) = RGBA{ { static_cast<uint8_t>(x),
+        static_cast<uint8_t>(y), static_cast<uint8_t>(rand() % 4),
+        static_cast<uint8_t>(rand()) } };
+
+  const auto temp_file = TempFile("bands.png");
+  const auto& filename = temp_file.path();
+  save_image(image, filename);
+  const auto loaded = Image(filename.parent_path(), filename.filename());
+  REQUIRE(loaded.width() == image.width());
+  REQUIRE(loaded.height() == image.height());
+  CHECK(std::equal(image.rgba(), image.rgba() + 700 * 300, loaded.rgba()));
+}
@@ -5,6 +5,8 @@
 #include "src/packing.h"
 #include "src/output.h"
 #include "src/debug.h"
+#include <fstream>
+#include <random>
 #include <sstream>
 
 using namespace spright;
@@ -55,6 +57,48 @@ namespace {
   #endif
     return slices[0];
   };
+
+  template<typename... Args>
+  std::string format_definition(const char* definition, const Args&... args) {
+    auto buffer = std::string(256, ' ');
+    buffer.resize(static_cast<size_t>(std::snprintf(
+      buffer.data(), buffer.size(), definition, args...)));
+    return buffer;
+  }
+
+  Rect get_packed_rect(const Sprite& sprite) {
+    auto rect = sprite.trimmed_rect;
+    if (sprite.rotated)
+      std::swap(rect.w, rect.h);
+    return rect;
+  }
+
+  bool has_overlapping_sprites(SpriteSpan sprites, int distance = 0) {
+    for (const auto& a : sprites)
+      for (const auto& b : sprites)
+        if (&a != &b && overlapping(
+              expand(get_packed_rect(a), distance), get_packed_rect(b)))
+          return true;
+    return false;
+  }
+
+  // unique file in the temporary directory, which is removed afterwards
+  class TempFile {
+  public:
+    explicit TempFile(const std::string& name)
+      : m_path(std::filesystem::temp_directory_path() / ("spright-" +
+          std::to_string(std::random_device()()) + "-" + name)) { }
+    TempFile(const TempFile&) = delete;
+    TempFile& operator=(const TempFile&) = delete;
+    ~TempFile() {
+      auto error = std::error_code();
+      std::filesystem::remove(m_path, error);
+    }
+    const std::filesystem::path& path() const { return m_path; }
+
+  private:
+    std::filesystem::path m_path;
+  };
 } // namespace
 
 TEST_CASE("packing - Basic") {
@@ -388,3 +432,502 @@ TEST_CASE("packing - Multiple sheets") {
   CHECK(slices[0].width <= 16);
   CHECK(slices[0].height <= 16);
 }
+
+TEST_CASE("packing - Convex trim") {
+  auto input = std::stringstream(R"(
+    sheet "sprites"
+    input "test/Items.png"
+      colorkey
+      trim convex
+      atlas
+  )");
+  auto parser = InputParser(Settings{ });
+  parser.parse(input);
+  auto sprites = std::move(parser).sprites();
+  trim_sprites(sprites);
+  REQUIRE(!sprites.empty());
+
+  for (const auto& sprite : sprites) {
+    REQUIRE(sprite.vertices.size() >= 3);
+    auto min = sprite.vertices.front();
+    auto max = min;
+    for (const auto& vertex : sprite.vertices) {
+      CHECK(vertex.x >= 0);
+      CHECK(vertex.y >= 0);
+      CHECK(vertex.x <= sprite.trimmed_source_rect.w);
+      CHECK(vertex.y <= sprite.trimmed_source_rect.h);
+      min = { std::min(min.x, vertex.x), std::min(min.y, vertex.y) };
+      max = { std::max(max.x, vertex.x), std::max(max.y, vertex.y) };
+    }
+    // outline spans trimmed rect, up to simplification tolerance
+    CHECK(max.x - min.x >= sprite.trimmed_source_rect.w - 3);
+    CHECK(max.y - min.y >= sprite.trimmed_source_rect.h - 3);
+  }
+}
+
+TEST_CASE("packing - Polygon trim") {
+  // L-shape
+  auto image = std::make_shared<Image>(40, 40, RGBA{ });
+  fill_rect(*image, { 5, 5, 10, 30 }, RGBA{ { 255, 0, 0, 255 } });
+  fill_rect(*image, { 5, 25, 30, 10 }, RGBA{ { 0, 255, 0, 255 } });
+
+  auto sprites = std::vector<Sprite>(1);
+  auto& sprite = sprites[0];
+  sprite.source = image;
+  sprite.source_rect = image->bounds();
+  sprite.trim = Trim::polygon;
+  sprite.trim_threshold = 1;
+  sprite.trim_vertices = 8;
+  sprite.trim_tolerance = 1;
+  trim_sprites(sprites);
+
+  CHECK(sprite.trimmed_source_rect == Rect{ 5, 5, 30, 30 });
+  REQUIRE(sprite.vertices.size() > 3);
+  CHECK(sprite.vertices.size() <= 9);
+
+  // masked copy keeps all pixels of the L-shape, but not the empty corner
+  const auto background = RGBA{ { 0, 0, 255, 255 } };
+  auto copy = Image(30, 30, background);
+  copy_rect(*image, sprite.trimmed_source_rect, copy, 0, 0, sprite.vertices);
+  for (auto y = 0; y < 30; ++y)
+    for (auto x = 0; x < 30; ++x) {
+      const auto& color = image->rgba_at({ x + 5, y + 5 });
+      if (color.a)
+        CHECK(copy.rgba_at({ x, y }) == color);
+      else if (x >= 13 && y < 17)
+        CHECK(copy.rgba_at({ x, y }) == background);
+    }
+}
+
+TEST_CASE("packing - Polygon trim margin") {
+  // U-shape
+  auto image = std::make_shared<Image>(50, 50, RGBA{ });
+  fill_rect(*image, { 10, 10, 8, 30 }, RGBA{ { 255, 0, 0, 255 } });
+  fill_rect(*image, { 32, 10, 8, 30 }, RGBA{ { 255, 0, 0, 255 } });
+  fill_rect(*image, { 10, 32, 30, 8 }, RGBA{ { 0, 255, 0, 255 } });
+
+  // crossing number test, points on the outline are inside
+  const auto contains = [](const std::vector<PointF>& polygon, const PointF& point) {
+    auto inside = false;
+    for (auto i = size_t{ }, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+      const auto& a = polygon[i];
+      const auto& b = polygon[j];
+      const auto cross = (b.x - a.x) * (point.y - a.y) - (b.y - a.y) * (point.x - a.x);
+      if (std::abs(cross) < 0.001 &&
+          point.x >= std::min(a.x, b.x) - 0.001 && point.x <= std::max(a.x, b.x) + 0.001 &&
+          point.y >= std::min(a.y, b.y) - 0.001 && point.y <= std::max(a.y, b.y) + 0.001)
+        return true;
+      if ((a.y > point.y) != (b.y > point.y) &&
+          point.x < (b.x - a.x) * (point.y - a.y) / (b.y - a.y) + a.x)
+        inside = !inside;
+    }
+    return inside;
+  };
+
+  for (auto margin : { 0, 1, 3 }) {
+    auto sprites = std::vector<Sprite>(1);
+    auto& sprite = sprites[0];
+    sprite.source = image;
+    sprite.source_rect = image->bounds();
+    sprite.trim = Trim::polygon;
+    sprite.trim_threshold = 1;
+    sprite.trim_vertices = 8;
+    sprite.trim_tolerance = 0.5;
+    sprite.trim_margin = margin;
+    trim_sprites(sprites);
+    REQUIRE(sprite.vertices.size() > 3);
+
+    // every opaque pixel, expanded by the margin, is within the polygon
+    const auto& rect = sprite.trimmed_source_rect;
+    const auto offset = to_real(margin);
+    for (auto y = 0; y < rect.h; ++y)
+      for (auto x = 0; x < rect.w; ++x)
+        if (image->rgba_at({ x + rect.x, y + rect.y }).a)
+          for (auto [dx, dy] : { std::pair{ 0, 0 }, std::pair{ 1, 0 },
+                                 std::pair{ 0, 1 }, std::pair{ 1, 1 } }) {
+            const auto corner = PointF{
+              std::clamp(x + dx + (dx ? offset : -offset), real{ 0 }, to_real(rect.w)),
+              std::clamp(y + dy + (dy ? offset : -offset), real{ 0 }, to_real(rect.h)) };
+            CHECK(contains(sprite.vertices, corner));
+          }
+
+    // the gap of the U-shape is not covered
+    CHECK(!contains(sprite.vertices, PointF{
+      to_real(25 - rect.x), to_real(20 - rect.y) }));
+  }
+}
+
+TEST_CASE("packing - Pack time") {
+  const auto definition = R"(
+    sheet "sprites"
+      allow-rotate true
+      pack-time %s
+    input "test/Items.png"
+      colorkey
+      atlas
+  )";
+  const auto pack_with_time = [&](const char* time) {
+    return pack_single_sheet(format_definition(definition, time).c_str());
+  };
+  // the sprites of a slice are only valid until the next pack
+  const auto slice = pack_with_time("0");
+  const auto sprite_count = slice.sprites.size();
+  const auto area = slice.width * slice.height;
+  const auto efficiency = get_slice_efficiency(slice);
+  const auto improved = pack_with_time("0.2");
+  REQUIRE(improved.sprites.size() == sprite_count);
+  CHECK(improved.width * improved.height <= area);
+  CHECK(get_slice_efficiency(improved) >= efficiency);
+  CHECK(!has_overlapping_sprites(improved.sprites));
+}
+
+TEST_CASE("packing - Incremental") {
+  const auto temp_file = TempFile("incremental.json");
+  const auto& filename = temp_file.path();
+
+  const auto get_definition = [&](bool add_sprite, const char* fragmentation) {
+    auto definition = std::string(R"(
+      sheet "sprites"
+        allow-rotate true
+        pack-incremental ")") + path_to_utf8(filename) + "\" " + fragmentation + R"(
+      input "test/Items.png"
+        colorkey
+        atlas
+    )";
+    if (add_sprite)
+      definition += R"(
+      input "test/Items.png"
+        sprite
+          rect 0 0 20 12
+      )";
+    return definition;
+  };
+  const auto pack_definition = [](const std::string& definition,
+      std::vector<Sprite>& sprites) {
+    auto input = std::stringstream(definition);
+    auto parser = InputParser(Settings{ });
+    parser.parse(input);
+    sprites = std::move(parser).sprites();
+    trim_sprites(sprites);
+    return pack_sprites(sprites);
+  };
+  const auto sort_by_index = [](std::vector<Sprite>& sprites) {
+    std::sort(sprites.begin(), sprites.end(),
+      [](const Sprite& a, const Sprite& b) { return a.index < b.index; });
+  };
+
+  // without a previous description it packs from scratch
+  auto sprites = std::vector<Sprite>();
+  auto slices = pack_definition(get_definition(false, "0.5"), sprites);
+  REQUIRE(slices.size() == 1);
+  auto file = std::ofstream(filename);
+  file << dump_description(R"({"sources":{{ sources }},"sprites":{{ sprites }}})",
+    sprites, slices);
+  file.close();
+  sort_by_index(sprites);
+
+  // previous sprites keep their place, a new one is inserted
+  auto incremental = std::vector<Sprite>();
+  slices = pack_definition(get_definition(true, "0.5"), incremental);
+  REQUIRE(slices.size() == 1);
+  REQUIRE(incremental.size() == sprites.size() + 1);
+  sort_by_index(incremental);
+  for (auto i = size_t{ }; i < sprites.size(); ++i) {
+    CHECK(incremental[i].trimmed_rect == sprites[i].trimmed_rect);
+    CHECK(incremental[i].rotated == sprites[i].rotated);
+  }
+  CHECK(!has_overlapping_sprites(incremental));
+
+  // too much fragmentation packs from scratch
+  auto repacked = std::vector<Sprite>();
+  pack_definition(get_definition(true, "0"), repacked);
+  auto fresh = std::vector<Sprite>();
+  std::filesystem::remove(filename);
+  pack_definition(get_definition(true, "0"), fresh);
+  REQUIRE(repacked.size() == fresh.size());
+  sort_by_index(repacked);
+  sort_by_index(fresh);
+  for (auto i = size_t{ }; i < fresh.size(); ++i) {
+    CHECK(repacked[i].slice_index == fresh[i].slice_index);
+    CHECK(repacked[i].trimmed_rect == fresh[i].trimmed_rect);
+    CHECK(repacked[i].rotated == fresh[i].rotated);
+  }
+}
+
+TEST_CASE("packing - Concurrent sheets") {
+  const auto sheets = std::vector<std::string>{
+    R"(
+    sheet "binpack"
+      allow-rotate
+      max-width 40
+    input "test/Items.png"
+      colorkey
+      atlas
+    )", R"(
+    sheet "compact"
+      pack compact
+    input "test/Items.png"
+      colorkey
+      atlas
+      trim convex
+    )", R"(
+    sheet "rows"
+      pack rows
+      duplicates drop
+    input "test/Items.png"
+      colorkey
+      atlas
+    )", R"(
+    sheet "shared"
+      duplicates share
+      power-of-two
+    input "test/Items.png"
+      colorkey
+      atlas
+    )",
+  };
+  const auto get_layout = [](const std::vector<Slice>& slices) {
+    auto layout = std::vector<std::tuple<std::string, int, int, 
+      std::vector<uint8_t>, std::vector<Rect>>>();
+    for (const auto& slice : slices) {
+      const auto image = get_slice_image(slice);
+      const auto pixels = reinterpret_cast<const uint8_t*>(image.rgba());
+      auto rects = std::vector<Rect>();
+      for (const auto& sprite : slice.sprites)
+        rects.push_back(sprite.trimmed_rect);
+      layout.emplace_back(slice.sheet->id, slice.width, slice.height,
+        std::vector<uint8_t>(pixels, pixels + image.width() * image.height() * 4),
+        std::move(rects));
+    }
+    return layout;
+  };
+
+  // pack sheets one after another
+  auto serial = decltype(get_layout({ })){ };
+  for (const auto& sheet : sheets) {
+    const auto layout = get_layout(pack(sheet.c_str()));
+    serial.insert(serial.end(), layout.begin(), layout.end());
+  }
+
+  auto all = std::string();
+  for (const auto& sheet : sheets)
+    all += sheet;
+  for (auto i = 0; i < 3; ++i)
+    CHECK(get_layout(pack(all.c_str())) == serial);
+}
+
+TEST_CASE("packing - Skyline") {
+  auto slice = pack_single_sheet(R"(
+    sheet "sprites"
+      pack skyline
+      allow-rotate true
+      padding 1
+    input "test/Items.png"
+      colorkey
+      atlas
+  )");
+  CHECK(le_size(slice, 64, 68));
+  CHECK(!has_overlapping_sprites(slice.sprites, 1));
+  for (const auto& sprite : slice.sprites)
+    CHECK(containing(Rect{ 1, 1, slice.width - 2, slice.height - 2 },
+      get_packed_rect(sprite)));
+
+  auto slices = pack(R"(
+    sheet "sprites"
+      pack skyline
+      max-width 40
+      max-height 40
+    input "test/Items.png"
+      colorkey
+      atlas
+  )");
+  CHECK(slices.size() >= 3);
+  for (const auto& slice : slices) {
+    CHECK(slice.width <= 40);
+    CHECK(slice.height <= 40);
+  }
+}
+
+TEST_CASE("packing - Hierarchical") {
+  auto slices = pack(R"(
+    sheet "sprites"
+      pack hierarchical
+      allow-rotate true
+      padding 2 1
+      max-width 48
+      max-height 48
+    input "test/Items.png"
+      colorkey
+      atlas
+  )");
+  auto count = size_t{ };
+  for (const auto& slice : slices) {
+    CHECK(slice.width <= 48);
+    CHECK(slice.height <= 48);
+    CHECK(!has_overlapping_sprites(slice.sprites, 2));
+    for (const auto& sprite : slice.sprites)
+      CHECK(containing(Rect{ 1, 1, 46, 46 }, get_packed_rect(sprite)));
+    count += slice.sprites.size();
+  }
+  CHECK(count == 31);
+}
+
+TEST_CASE("packing - Compact") {
+  const auto definition = R"(
+    sheet "sprites"
+      pack %s
+      max-width 60
+      max-height 60
+    input "test/Items.png"
+      colorkey
+      atlas
+      trim convex
+  )";
+  const auto pack_method = [&](const char* method) {
+    auto slices = pack(format_definition(definition, method).c_str());
+    auto sizes = std::vector<std::pair<int, int>>();
+    for (const auto& slice : slices) {
+      for (const auto& sprite : slice.sprites)
+        CHECK(containing(Rect{ 0, 0, slice.width, slice.height },
+          sprite.trimmed_rect));
+      sizes.emplace_back(slice.width, slice.height);
+    }
+    return sizes;
+  };
+  const auto binpack = pack_method("binpack");
+  const auto compact = pack_method("compact");
+  REQUIRE(compact.size() == binpack.size());
+  for (auto i = size_t{ }; i < compact.size(); ++i) {
+    CHECK(compact[i].first <= binpack[i].first);
+    CHECK(compact[i].second <= binpack[i].second);
+  }
+}
+
+TEST_CASE("packing - Pixels") {
+  const auto definition = R"(
+    sheet "sprites"
+      pack %s
+      padding %s
+    input "test/Items.png"
+      colorkey
+      atlas
+  )";
+  const auto pack_with = [&](const char* method, const char* padding) {
+    return pack_single_sheet(
+      format_definition(definition, method, padding).c_str());
+  };
+
+  for (auto padding : { 0, 1, 2 }) {
+    const auto padding_string = std::to_string(padding);
+    const auto slice = pack_with("pixels", padding_string.c_str());
+
+    // visible pixels are at least padding apart
+    auto owner = std::vector<int>(
+      static_cast<size_t>(slice.width * slice.height), -1);
+    for (const auto& sprite : slice.sprites) {
+      const auto& rect = sprite.trimmed_source_rect;
+      for (auto y = 0; y < rect.h; ++y)
+        for (auto x = 0; x < rect.w; ++x) {
+          if (!sprite.source->rgba_at({ rect.x + x, rect.y + y }).a)
+            continue;
+          const auto px = sprite.trimmed_rect.x + x;
+          const auto py = sprite.trimmed_rect.y + y;
+          REQUIRE(containing(Rect{ padding, padding, 
+            slice.width - 2 * padding, slice.height - 2 * padding }, Point{ px, py }));
+          for (auto dy = -padding; dy <= padding; ++dy)
+            for (auto dx = -padding; dx <= padding; ++dx) {
+              if (!containing(Rect{ 0, 0, slice.width, slice.height }, 
+                    Point{ px + dx, py + dy }))
+                continue;
+              const auto other = owner[static_cast<size_t>(
+                (py + dy) * slice.width + px + dx)];
+              CHECK((other < 0 || other == sprite.index));
+            }
+          owner[static_cast<size_t>(py * slice.width + px)] = sprite.index;
+        }
+    }
+  }
+}
+
+TEST_CASE("packing - Pixels interlocking") {
+  // triangles in both orientations, which can be combined to squares
+  const auto temp_file = TempFile("triangles.png");
+  const auto& filename = temp_file.path();
+  auto image = Image(8 * 24, 4 * 24, RGBA{ });
+  for (auto i = 0; i < 32; ++i)
+    for (auto y = 0; y < 24; ++y)
+      for (auto x = 0; x < 24; ++x)
+        if ((i % 2) ? (x + y >= 23) : (x + y < 24))
+          image.rgba_at({ (i % 8) * 24 + x, (i / 8) * 24 + y }) =
+            RGBA{ { 255, 255, 255, 255 } };
+  save_image(image, filename);
+
+  const auto pack_method = [&](const char* method) {
+    const auto definition = std::string(R"(
+      sheet "sprites"
+        pack )") + method + R"(
+      input ")" + path_to_utf8(filename) + R"("
+        grid 24 24
+    )";
+    return pack_single_sheet(definition.c_str());
+  };
+  const auto pixels = pack_method("pixels");
+  const auto binpack = pack_method("binpack");
+  REQUIRE(pixels.sprites.size() == 32);
+  CHECK(pixels.width * pixels.height * 4 <= binpack.width * binpack.height * 3);
+}
+
+TEST_CASE("packing - Size classes") {
+  // glyph cells of the same size and a few leftovers
+  const auto temp_file = TempFile("glyphs.png");
+  const auto& filename = temp_file.path();
+  auto image = Image(40 * 10, 25 * 12, RGBA{ });
+  for (auto i = 0; i < 1000; ++i)
+    fill_rect(image, { (i % 40) * 10, (i / 40) * 12, 10, 12 },
+      RGBA{ { 255, 255, 255, 255 } });
+  save_image(image, filename);
+
+  const auto pack_glyphs = [&](const char* settings) {
+    const auto definition = std::string(R"(
+      sheet "sprites"
+        padding 1
+        )") + settings + R"(
+      input ")" + path_to_utf8(filename) + R"("
+        grid 10 12
+      input "test/Items.png"
+        colorkey
+        atlas
+    )";
+    auto slices = std::vector<Slice>();
+    REQUIRE_NOTHROW(slices = pack(definition.c_str()));
+    return slices;
+  };
+
+  const auto is_valid = [](const Slice& slice) {
+    for (const auto& sprite : slice.sprites)
+      if (!containing(Rect{ 0, 0, slice.width, slice.height },
+            get_packed_rect(sprite)))
+        return false;
+    return !has_overlapping_sprites(slice.sprites, 1);
+  };
+
+  auto slices = pack_glyphs("");
+  REQUIRE(slices.size() == 1);
+  CHECK(slices[0].sprites.size() == 1031);
+  CHECK(is_valid(slices[0]));
+  // the glyphs alone would fill a grid of 11x13 cells
+  CHECK(slices[0].width * slices[0].height < 1000 * 11 * 13 * 11 / 10);
+
+  slices = pack_glyphs(R"(
+        max-width 128
+        max-height 128
+        allow-rotate true)");
+  auto count = size_t{ };
+  for (const auto& slice : slices) {
+    CHECK(slice.width <= 128);
+    CHECK(slice.height <= 128);
+    CHECK(is_valid(slice));
+    count += slice.sprites.size();
+  }
+  CHECK(count == 1031);
+}
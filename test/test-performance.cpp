@@ -2,8 +2,10 @@
 #include "catch.hpp"
 #include "src/image.h"
 #include "src/FilenameSequence.h"
-#include "rect_pack/rect_pack.h"
+#include "src/packing.h"
+#include <chrono>
 #include <random>
+#include <thread>
 
 using namespace spright;
 
@@ -66,6 +68,45 @@ namespace {
     save_image(image, filename);
   }
 
+  template<typename F>
+  double measure_seconds(F&& function) {
+    using Clock = std::chrono::steady_clock;
+    const auto begin = Clock::now();
+    function();
+    return std::chrono::duration<double>(Clock::now() - begin).count();
+  }
+
+  // time limits are only meaningful for optimized builds
+  bool is_within_time_limit(double seconds, double limit) {
+#if defined(NDEBUG)
+    return seconds < limit;
+#else
+    (void)seconds;
+    (void)limit;
+    return true;
+#endif
+  }
+
+  // scales the time limit of a parallel algorithm, which was measured
+  // with 16 hardware threads, to the hardware threads available
+  double scale_to_hardware_threads(double limit) {
+    const auto threads = std::max(std::thread::hardware_concurrency(), 1u);
+    return limit * std::max(16.0 / threads, 1.0);
+  }
+
+  bool is_overlapping(const rect_pack::Sheet& sheet) {
+    auto rects = sheet.rects;
+    std::sort(rects.begin(), rects.end(),
+      [](const auto& a, const auto& b) { return a.x < b.x; });
+    for (auto i = size_t{ }; i < rects.size(); ++i)
+      for (auto j = i + 1; j < rects.size() && 
+          rects[j].x < rects[i].x + rects[i].width; ++j)
+        if (rects[j].y < rects[i].y + rects[i].height &&
+            rects[i].y < rects[j].y + rects[j].height)
+          return true;
+    return false;
+  }
+
   template<typename T>
   bool le_size(const T& texture, int w, int h) {
     // here one can set a breakpoint to tighten the size constraints
@@ -132,3 +173,75 @@ TEST_CASE("performance - 1000 Skyline") {
 
   //dump(generate_image(sheets[0], sizes));
 }
+
+TEST_CASE("performance - 100k Skyline") {
+  auto sizes = generate_pack_sizes({
+    { 50000, 2, 2, 8, 8, true },
+    { 50000, 8, 4, 16, 12, true },
+  });
+  auto sheets = std::vector<rect_pack::Sheet>();
+  const auto seconds = measure_seconds([&]() {
+    sheets = pack_skyline({ .allow_rotate = true }, sizes);
+  });
+  CHECK(is_within_time_limit(seconds, 1.0));
+  REQUIRE(sheets.size() == 1);
+  CHECK(sheets[0].rects.size() == sizes.size());
+  CHECK(le_size(sheets[0], 2480, 2480));
+  CHECK(!is_overlapping(sheets[0]));
+}
+
+TEST_CASE("performance - 1M Skyline") {
+  auto sizes = generate_pack_sizes({
+    { 1000000, 1, 1, 8, 8, true },
+  });
+  auto sheets = std::vector<rect_pack::Sheet>();
+  const auto seconds = measure_seconds([&]() {
+    sheets = pack_skyline({ .max_width = 2048, .max_height = 2048 }, sizes);
+  });
+  CHECK(is_within_time_limit(seconds, 10.0));
+  auto count = size_t{ };
+  for (const auto& sheet : sheets) {
+    CHECK(sheet.width <= 2048);
+    CHECK(sheet.height <= 2048);
+    count += sheet.rects.size();
+  }
+  CHECK(count == sizes.size());
+}
+
+TEST_CASE("performance - 1M Hierarchical") {
+  auto sizes = generate_pack_sizes({
+    { 500000, 1, 1, 8, 8, true },
+    { 400000, 8, 4, 16, 12, true },
+    { 100000, 16, 16, 32, 32, true },
+  });
+  const auto settings = rect_pack::Settings{
+    .allow_rotate = true,
+    .over_allocate = 1,
+    .max_width = 4096,
+    .max_height = 4096,
+  };
+  auto sheets = std::vector<rect_pack::Sheet>();
+  const auto seconds = measure_seconds([&]() {
+    sheets = pack_hierarchical(settings, sizes);
+  });
+  CHECK(is_within_time_limit(seconds, scale_to_hardware_threads(10.0)));
+
+  const auto get_area = [](const std::vector<rect_pack::Sheet>& sheets) {
+    auto area = int64_t{ };
+    for (const auto& sheet : sheets)
+      area += int64_t{ sheet.width } * sheet.height;
+    return area;
+  };
+  auto count = size_t{ };
+  for (const auto& sheet : sheets) {
+    CHECK(sheet.width <= 4096);
+    CHECK(sheet.height <= 4096);
+    CHECK(!is_overlapping(sheet));
+    count += sheet.rects.size();
+  }
+  CHECK(count == sizes.size());
+
+  // bounded density cost compared to packing all at once
+  const auto flat_area = get_area(pack_skyline(settings, sizes));
+  CHECK(get_area(sheets) <= flat_area * 6 / 5);
+}